@@ -2612,6 +2612,10 @@ WindowsHandler* WH;
 //////////////////////////////
 
 #include "grav_eq_iterator.h"
+#include "quad_tree_draw.h"
+#include "scaling_benchmark.h"
+#include "initial_conditions.h"
+#include "sph_replay.h"
 //#include "buddhabrot.h"
 
 struct FieldAdapter : HandleableUIPart {
@@ -2667,13 +2671,20 @@ struct SPHAdapter : FieldAdapter {
 	int draw_level;
 	bool extra_flare, edge_drawer, point_drawer, ext_draw;
 	grav_eq_processor* gep;
+	//replaying snapshots from disk instead, gep is null then
+	sph_replay::player* replay;
+	bool is_replaying;
 	draw_type::dt draw_type;
 	SPHAdapter(grav_eq_processor* gep, float x, float y, float side_size, float particle_size, float brightness) :
-		FieldAdapter(nullptr, x, y, side_size, particle_size, brightness), gep(gep), draw_type(draw_type::dt::density), draw_level(15), extra_flare(false), edge_drawer(false), point_drawer(false), ext_draw(false){ }
+		FieldAdapter(nullptr, x, y, side_size, particle_size, brightness), gep(gep), replay(nullptr), is_replaying(false), draw_type(draw_type::dt::density), draw_level(15), extra_flare(false), edge_drawer(false), point_drawer(false), ext_draw(false){ }
 	void Draw() override {
-		gep->pre_swap.lock();
-		gep->current.draw(draw_level, { x,y }, side_size, pixel_size, brightness, draw_type, extra_flare, edge_drawer, point_drawer, ext_draw);
-		gep->pre_swap.unlock();
+		if (replay) {
+			if (auto frame = replay->current())
+				draw_tree(*frame->tree, draw_level, { x,y }, side_size, pixel_size, brightness, draw_type, extra_flare, edge_drawer, point_drawer, ext_draw);
+			return;
+		}
+		auto snapshot = gep->snapshot();
+		draw_tree(*snapshot->tree, draw_level, { x,y }, side_size, pixel_size, brightness, draw_type, extra_flare, edge_drawer, point_drawer, ext_draw);
 	}
 	BIT MouseHandler(float mx, float my, CHAR Button, CHAR State) override {
 		if (false && fabsf(mx - x) < 0.5 * side_size && fabsf(my - y) < 0.5 * side_size) {
@@ -2685,13 +2696,17 @@ struct SPHAdapter : FieldAdapter {
 };
 
 SPHAdapter*SPH_Adapter_ptr = new SPHAdapter(nullptr, 0, 0, 400, 2, 1);
+//snapshot files or directories of them from the command line, replayed instead of a simulation
+std::vector<std::string> replay_paths;
+std::string Replay_Failure;
 TextBox *TB_ptr = new TextBox("", System_White, -260, -155 - WindowHeapSize, 10, 70, 10, 0, 0xFFFFFFFF, 1, _Align::center);
 
 void OnWheel_BrightPress(double var) {
 	SPH_Adapter_ptr->brightness = var;
 }
 void OnWheel_TimeStep(double var) {
-	SPH_Adapter_ptr->gep->time_step = var;
+	if (SPH_Adapter_ptr->gep)
+		SPH_Adapter_ptr->gep->time_step = var;
 }
 void OnWheel_DrawDepth(double var) {
 	SPH_Adapter_ptr->draw_level = var;
@@ -2713,17 +2728,32 @@ void OnSelectPropList(int ID) {
 		SPH_Adapter_ptr->draw_type = draw_type::dt::y_acceleration; break;
 	}
 }
+WheelVariableChanger* Frame_WVC_ptr = nullptr;
+void ShowReplayPosition() {
+	if (!Frame_WVC_ptr)
+		return;
+	size_t position = SPH_Adapter_ptr->replay->position();
+	Frame_WVC_ptr->variable = (double)position;
+	Frame_WVC_ptr->var_if->UpdateInputString(to_string(position));
+}
+void ReplaySeek(int64_t frame) {
+	SPH_Adapter_ptr->replay->seek(frame);
+	ShowReplayPosition();
+}
+void OnWheel_Frame(double var) {
+	ReplaySeek((int64_t)var);
+}
 void Pause() {
-	SPH_Adapter_ptr->gep->is_paused ^= true;
-	switch (SPH_Adapter_ptr->gep->is_paused)
-	{
-	case true:
-		SPH_Adapter_ptr->gep->pause.lock();
-		break;
-	case false:
-		SPH_Adapter_ptr->gep->pause.unlock();
-		break;
+	if (auto replay = SPH_Adapter_ptr->replay) {
+		SPH_Adapter_ptr->is_replaying ^= true;
+		if (SPH_Adapter_ptr->is_replaying && !replay->has_next(1))
+			ReplaySeek(0);
+		return;
 	}
+	if (SPH_Adapter_ptr->gep->is_paused)
+		SPH_Adapter_ptr->gep->resume();
+	else
+		SPH_Adapter_ptr->gep->pause();
 }
 
 ButtonSettings *BS_List_Black_Small = new ButtonSettings(System_White, 0, 0, 100, 10, 1, 0, 0, 0xFFEFDFFF, 0x00003F7F, 0x7F7F7FFF);
@@ -2733,7 +2763,10 @@ void Init() {
 	SelectablePropertedList *L;
 	auto T = new MoveableWindow("Field window", System_White, -325, 200 + WindowHeapSize, 525, 400 + WindowHeapSize, 0xFF, 0x7F7F7F7F);
 	(*T)["BRIGHTNESS"] = WVC_ptr = new WheelVariableChanger(OnWheel_BrightPress, -260, 175 - WindowHeapSize, SPH_Adapter_ptr->brightness, 0.1, System_White, "Brightness", "Delta", WheelVariableChanger::Type::linear);
-	(*T)["TIMESTEP"] = new WheelVariableChanger(OnWheel_TimeStep, -260, 120 - WindowHeapSize, SPH_Adapter_ptr->gep->time_step, 2, System_White, "Time step", "Delta", WheelVariableChanger::Type::exponential);
+	if (SPH_Adapter_ptr->replay)
+		(*T)["FRAME"] = Frame_WVC_ptr = new WheelVariableChanger(OnWheel_Frame, -260, 120 - WindowHeapSize, 0, 1, System_White, "Frame", "Delta", WheelVariableChanger::Type::linear);
+	else
+		(*T)["TIMESTEP"] = new WheelVariableChanger(OnWheel_TimeStep, -260, 120 - WindowHeapSize, SPH_Adapter_ptr->gep->time_step, 2, System_White, "Time step", "Delta", WheelVariableChanger::Type::exponential);
 	(*T)["DRAW_DEPTH"] = new WheelVariableChanger(OnWheel_DrawDepth, -260, 65 - WindowHeapSize, SPH_Adapter_ptr->draw_level, 1, System_White, "Draw depth", "Delta", WheelVariableChanger::Type::linear);
 	//(*T)["PRATE"] = new WheelVariableChanger(OnWheel_PRPress, -260, 10 - WindowHeapSize, bb::progressrate, 0.5, System_White, "PRate", "Delta", WheelVariableChanger::Type::linear);
 	(*T)["LIST"] = L = new SelectablePropertedList(BS_List_Black_Small, OnSelectPropList, nullptr, -260, -100 - WindowHeapSize, 70, 10, 15, 6, _Align::center);
@@ -2757,28 +2790,25 @@ void mDisplay() {
 	if (FIRSTBOOT) {
 		FIRSTBOOT = 0;
 
-		constexpr double size = 100;
-		constexpr double size_fraction = 1.535;
-		constexpr int amount = 1280;
-		vector<particle> vec;
-
-		for (int i = 0; i < amount; i++) {
-			auto t = (rand() & 1 ? -1 : 1);
-			point temp = { RANDFLOAT(size / size_fraction), RANDFLOAT(size / size_fraction) };
-			if (temp.norma() > size / size_fraction)
-				continue;
-			vec.push_back(particle(
-				temp*0.75,
-				(point{ -temp[1],temp[0] }) * 0.0,
-				{0,0},
-				100  /* * t + 7.4365*/, 0.1, 0, 1
-			));
+		if (replay_paths.size()) {
+			try {
+				SPH_Adapter_ptr->replay = new sph_replay::player(sph_replay::list_snapshots(replay_paths));
+				cout << "Replaying " << SPH_Adapter_ptr->replay->size() << " snapshots" << endl;
+			}
+			catch (const std::exception& e) {
+				cout << "Cannot replay: " << e.what() << endl;
+			}
 		}
+		if (!SPH_Adapter_ptr->replay) {
+			constexpr double size = 100;
+			initial_conditions::cloud cloud;
+			cloud.amount = 1280;
+			auto vec = initial_conditions::uniform_disc(cloud, initial_conditions::viewer_disc_radius(size));
 
-		SPH_Adapter_ptr->gep = new grav_eq_processor(vec, size);
+			SPH_Adapter_ptr->gep = new grav_eq_processor(vec, size);
 
-		SPH_Adapter_ptr->gep->start_threads();
-		Pause();
+			SPH_Adapter_ptr->gep->start_threads(true);
+		}
 
 		WH = new WindowsHandler();
 		Init();
@@ -2805,6 +2835,22 @@ void mInit() {
 void onTimer(int v) {
 	glutTimerFunc(33, onTimer, 0);
 	if (ANIMATION_IS_ACTIVE) {
+		//a frame per tick while the prefetcher keeps up, the frame on screen stays while it does not
+		auto replay = SPH_Adapter_ptr->replay;
+		if (replay && SPH_Adapter_ptr->is_replaying) {
+			if (replay->advance(1))
+				ShowReplayPosition();
+			if (!replay->has_next(1))
+				SPH_Adapter_ptr->is_replaying = false;
+		}
+		//frames which fail to load are skipped, said once each
+		if (replay) {
+			auto failure = replay->last_failure();
+			if (failure != Replay_Failure) {
+				Replay_Failure = failure;
+				cout << "Replay: " << failure << endl;
+			}
+		}
 		mDisplay();
 		++TimerV;
 	}
@@ -2835,7 +2881,13 @@ void mKey(BYTE k, int x, int y) {
 	if (WH)WH->KeyboardHandler(k);
 
 	if (k == '=') { ANIMATION_IS_ACTIVE = !ANIMATION_IS_ACTIVE; }
-	else if (k == 27)exit(1);
+	else if (k == 27) {
+		if (SPH_Adapter_ptr && SPH_Adapter_ptr->gep)
+			SPH_Adapter_ptr->gep->stop_threads();
+		if (SPH_Adapter_ptr && SPH_Adapter_ptr->replay)
+			delete SPH_Adapter_ptr->replay;
+		exit(1);
+	}
 	else {
 		switch (k) {
 		case 'w':
@@ -2860,7 +2912,8 @@ void mKey(BYTE k, int x, int y) {
 			SPH_Adapter_ptr->edge_drawer ^= true;
 			break;
 		case 'q':
-			SPH_Adapter_ptr->gep->flickering ^= true;
+			if (SPH_Adapter_ptr->gep)
+				SPH_Adapter_ptr->gep->flickering ^= true;
 			break;
 		case 'v':
 			SPH_Adapter_ptr->point_drawer ^= true;
@@ -2874,6 +2927,24 @@ void mKey(BYTE k, int x, int y) {
 		case '`':
 			SPH_Adapter_ptr->ext_draw ^= true;
 			break;
+		case 'b':
+			sph_precision::benchmark<grav_eq_utils::kernel_type>();
+			break;
+		case 'n':
+			if (SPH_Adapter_ptr->gep && !SPH_Adapter_ptr->gep->is_paused)
+				Pause();
+			scaling_benchmark::run();
+			break;
+		//replay scrubbing: a frame, or a tenth of the run
+		case ',':
+		case '.':
+		case '<':
+		case '>':
+			if (auto replay = SPH_Adapter_ptr->replay) {
+				int64_t frames = (k == ',' || k == '.') ? 1 : max<int64_t>((int64_t)replay->size() / 10, 1);
+				ReplaySeek((int64_t)replay->position() + ((k == ',' || k == '<') ? -frames : frames));
+			}
+			break;
 		}//ForceUpdateValue
 	}
 }
@@ -2914,6 +2985,8 @@ int main(int argc, char** argv) {
 
 	srand(TIMESEED());
 	__glutInitWithExit(&argc, argv, mExit);
+	for (int i = 1; i < argc; i++)
+		replay_paths.push_back(argv[i]);
 	glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGBA);
 	glutInitWindowSize(WINDXSIZE, WINDYSIZE);
 	glutCreateWindow(WINDOWTITLE);
@@ -0,0 +1,34 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+
+//counter-based random numbers: value number n of a stream is a hash of (seed, stream, n), nothing is carried
+//from one draw to the next. any thread can draw any value of any stream, so work split over threads in any
+//way gives the same numbers as one thread. the mixing is the splitmix64 finaliser over a weyl sequence
+struct counter_rng {
+	uint64_t key;
+
+	inline static uint64_t mix(uint64_t z) {
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+
+	counter_rng(uint64_t seed, uint64_t stream = 0) :
+		key(mix(mix(seed + 0x9E3779B97F4A7C15ull) ^ (stream * 0xD1B54A32D192ED03ull + 0x8CB92BA72F3D8DD7ull))) {}
+
+	inline uint64_t bits(uint64_t counter) const {
+		return mix(key + (counter + 1) * 0x9E3779B97F4A7C15ull);
+	}
+	//[0, 1), 53 random bits
+	inline double uniform(uint64_t counter) const {
+		return (bits(counter) >> 11) * (1. / 9007199254740992.);
+	}
+	//standard normal from the counters 2 * counter and 2 * counter + 1 (box-muller)
+	inline double normal(uint64_t counter) const {
+		constexpr double two_pi = 6.283185307179586476925286766559;
+		double u = 1. - uniform(2 * counter);
+		double v = uniform(2 * counter + 1);
+		return std::sqrt(-2. * std::log(u)) * std::cos(two_pi * v);
+	}
+};
@@ -5,11 +5,24 @@
 #include <vector>
 #include <functional>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <chrono>
-#include "field_vis.h"
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
 #include "weird_hacks.h"
 #include "consts.h"
 #include "multidimentional_point.h"
+#include "sph_kernels.h"
+#include "sph_simd.h"
+#include "sph_eos.h"
+#include "sph_precision.h"
+#include "sph_smoothing.h"
+#include "work_stealing.h"
+#include "thread_affinity.h"
 
 #include <stack>
 #include <queue>
@@ -18,13 +31,14 @@
 
 	#define is_variable_timestep // uncomment to push it working again...
 	#define measuring_performance
+	//#define mixed_precision // float pair kernels, sums stay in double
 
 using namespace std;
 using point = Point<2>;
 
 namespace _____type_desc {
-	auto p_zero = [&](double t, const point& x) -> point { return point(); };
-	auto d_zero = [&](double t, double x) -> double { return 0.; };
+	auto p_zero = [](double t, const point& x) -> point { return point(); };
+	auto d_zero = [](double t, double x) -> double { return 0.; };
 }
 
 using p_lambda = std::function<point(double, const point&)>;
@@ -53,28 +67,65 @@ namespace grav_eq_utils {
 		return n_vec >= lb_sq && n_vec <= rt_sq;
 	}
 	constexpr double epsilon = 0.005;
+
+	//distance along a hilbert curve filling the square, 16 bits per axis
+	inline uint32_t hilbert_key(const point& lb_sq, const point& rt_sq, const point& p_pos) {
+		constexpr uint32_t side = 1u << 16;
+		uint32_t x = (uint32_t)clamp((_x(p_pos) - _x(lb_sq)) / (_x(rt_sq) - _x(lb_sq)) * side, 0., side - 1.);
+		uint32_t y = (uint32_t)clamp((_y(p_pos) - _y(lb_sq)) / (_y(rt_sq) - _y(lb_sq)) * side, 0., side - 1.);
+		uint32_t key = 0;
+		for (uint32_t s = side / 2; s > 0; s /= 2) {
+			uint32_t rx = (x & s) > 0;
+			uint32_t ry = (y & s) > 0;
+			key += s * s * ((3 * rx) ^ ry);
+			if (!ry) {
+				if (rx) {
+					x = side - 1 - x;
+					y = side - 1 - y;
+				}
+				std::swap(x, y);
+			}
+		}
+		return key;
+	}
+
+	//compile-time kernel choice: sph_kernels::spiky, cubic_spline, wendland_c2, wendland_c4
+	//or any of them wrapped into sph_kernels::tabulated<...>
+	using kernel_type = sph_kernels::spiky;
+	using kernel_scale = sph_kernels::scale<kernel_type>;
+
+	//compile-time equation of state, see sph_eos.h.
+	//14/9 is polytropic_coef / 3 + 1 with the former polytropic_coef = 5/3
+	using eos_type = sph_eos::heated_polytrope<14, 9>;
+
+	//precision of the SPH pair terms, see sph_precision.h for what it costs
+#ifdef mixed_precision
+	using pair_real = float;
+#else
+	using pair_real = double;
+#endif
+	using neighbour_batch = sph_simd::basic_neighbour_batch<pair_real>;
+	using smoothing_solver = sph_smoothing::solver<kernel_type>;
+
+	inline double pressure_core(const point& r, const kernel_scale& scale) {
+		return scale.value(r.norma());
+	}
 	inline double pressure_core(const point& r, double h) {
-		constexpr double constant = 4.;
-		double r_norm = r.norma();
-		if (r_norm < h) 
-			return constant* std::pow(h - r_norm, 3) / std::pow(h, 4);
-		else
-			return 0.;
+		return pressure_core(r, kernel_scale(h));
 	}
-	inline point pressure_core_gradient(const point& r, double h) {
-		constexpr double constant = -12.;
+	inline point pressure_core_gradient(const point& r, const kernel_scale& scale) {
 		double r_norm = r.norma();
-		if (r_norm < h && std::abs(r_norm)>epsilon)
-			return constant * (r / r_norm) * std::pow(h - r_norm, 2) / std::pow(h, 4);
+		if (r_norm < scale.h && std::abs(r_norm)>epsilon)
+			return (r / r_norm) * scale.gradient(r_norm);
 		else
 			return {0,0};
 	}
+	inline point pressure_core_gradient(const point& r, double h) {
+		return pressure_core_gradient(r, kernel_scale(h));
+	}
+	//drawing only, has to stay in pair with inverse_pressure_core
 	inline double pressure_core(double r, double h) {
-		constexpr double constant = 4.;
-		if (r < h)
-			return constant * std::pow(h - r, 3) / std::pow(h, 4);
-		else
-			return 0.;
+		return sph_kernels::scale<sph_kernels::spiky>(h).value(r);
 	}
 	inline double inverse_pressure_core(double d, double h) {
 		if (0 <= d && d <= h)
@@ -83,28 +134,8 @@ namespace grav_eq_utils {
 	}
 };
 
-inline void draw_smooth_circle(const float x, const float y, const float r, const float value, const float dvalue, const float dangle) {
-	float begin = grav_eq_utils::pressure_core(0, r);
-	for (float val = begin; val > 0.005; val /= dvalue) {
-
-		float rad = grav_eq_utils::inverse_pressure_core(val, r);
-
-		auto [pr, pg, pb] = get_color(val*value);
-
-		glColor4f(pr, pg, pb, 0.025f);
-
-		glBegin(GL_POLYGON);
-	
-		for (float i = 0.f; i < 360.f; i += dangle)
-			glVertex2f(rad * cos(ANGTORAD(i)) + x, rad * sin(ANGTORAD(i)) + y);
-
-		glEnd();
-
-	}
-}
-
 struct particle {
-	static constexpr int desired_amount_of_interactions = 10;//25^(2/3) ~ 8.5//+1 for noninteractive particle
+	static constexpr int desired_amount_of_interactions = 10;//25^(2/3) ~ 8.5//target of the smoothing length solver
 	int interactions_count;
 	point position;
 	point velocity;
@@ -115,6 +146,8 @@ struct particle {
 #ifdef is_variable_timestep
 	double cfl_time;
 #endif
+	double cost;//microseconds spent on it in the previous steps, summed over subtrees
+	double density;//from the density phase of the step which produced it, 0 before the first step
 	bool visited;
 	particle(point position = { 0.,0. }, point velocity = { 0.,0. }, point acceleration = { 0.,0. }, double part_mass = 0., double radius = 0., double energy = 0., int amount_of_interactions = 1
 #ifdef is_variable_timestep
@@ -127,6 +160,8 @@ struct particle {
 #endif
 	{
 		visited = false;
+		cost = 0;
+		density = 0;
 	}
 	inline bool operator==(const particle& prt) const {
 		using namespace grav_eq_utils;
@@ -136,7 +171,7 @@ struct particle {
 	inline particle operator+(const particle& prt) const {
 		double ratio = mass / (prt.mass + mass);
 		double aratio = 1. - ratio;
-		return particle(
+		particle sum(
 			ratio * position + aratio * prt.position,
 			ratio * velocity + aratio * prt.velocity,
 			ratio * acceleration + aratio * prt.acceleration,
@@ -148,6 +183,9 @@ struct particle {
 			, min(cfl_time, prt.cfl_time)
 #endif
 		);
+		sum.cost = cost + prt.cost;
+		sum.visited = visited || prt.visited;
+		return sum;
 	}
 	//inverse to operator+
 	/*
@@ -175,13 +213,6 @@ struct particle {
 };
 
 
-namespace draw_type {
-	enum class dt {
-		density, energy, x_speed, y_speed, x_acceleration, y_acceleration
-	};
-}
-
-
 struct node {
 	enum positioning {
 		leftbottom = 0, lefttop = 1, righttop = 2, rightbottom = 3, null = 4
@@ -196,10 +227,14 @@ struct node {
 	node* null_node;
 	point leftbottom_corner;
 	point righttop_corner;
+	//of a leaf of the current tree, filled by the density and energy phases of a step
+	double density_cache;
+	double energy_cache;
 	node() {
 		null_node = nullptr;
 		left_bottom = left_top = right_bottom = right_top = parent = nullptr;
 		particles_count_in_subtrees = 0;
+		density_cache = energy_cache = 0;
 		leftbottom_corner = righttop_corner = { 0,0 };
 		mass_center = particle();
 	}
@@ -230,7 +265,7 @@ struct node {
 			righttop_corner = parent->righttop_corner - local_shift;
 			break;
 		case null:
-			throw std::exception("Constructed beyond meaningful area!", (int)parent);
+			throw std::runtime_error("Constructed beyond meaningful area!");
 			break;
 		}
 	}
@@ -316,70 +351,63 @@ inline void radius_node_catcher(node* center, double radius, std::vector<node*>*
 	//printf("radius_nodes: %i\n", rad_nodes->size());
 }
 
+//nodes are bump allocated from chunks which are never given back:
+//reset() frees every node at once and the next tree is built into the same memory.
+//node is trivially destructible, so a slot is just constructed over again
+struct node_arena {
+	static constexpr size_t chunk_size = 1024;
+	std::vector<std::unique_ptr<node[]>> chunks;
+	size_t used = 0;
+
+	template<typename... Args>
+	inline node* make(Args&&... args) {
+		if (used == chunks.size() * chunk_size)
+			chunks.emplace_back(new node[chunk_size]);
+		node* slot = &chunks[used / chunk_size][used % chunk_size];
+		used++;
+		return new (slot) node(std::forward<Args>(args)...);
+	}
+	inline void reset() {
+		used = 0;
+	}
+};
+
 struct quad_tree {
 	//node*, node* = (temp,cur_node)
 	using positioning = node::positioning;
 
 	node* root_node;
-	//node_reserver* reserver;
+	//every node except the root lives in an arena of its tree: the top levels (and sequential pushes) in top_arena,
+	//the subtree of each cell of a parallel build in its own one, so cells are filled without any locking
+	node_arena top_arena;
+	std::vector<node_arena> cell_arenas;
 	recursive_mutex locker;
 	recursive_mutex swap_prevention;
-	quad_tree() /*: reserver(new node_reserver())*/ {
+	quad_tree() {
 		root_node = nullptr;
 	}
 	quad_tree(double size) : quad_tree() {
-		//root_node = reserver->get_unused();
 		root_node = new node();
 		root_node->leftbottom_corner = { -size * 0.5,-size * 0.5 };
 		root_node->righttop_corner = { size * 0.5,size * 0.5 };
 	}
 	~quad_tree() {
-		clear();
+		delete root_node;
 	}
 
+	//O(1) in the size of the tree, nodes are not visited
 	inline void clear() {
 		locker.lock();
-		std::stack<node*> cur_nodes;
-
-		node* cur_node = root_node;
-		node* temp = nullptr;
-		node** ptemp;
-		for (positioning i = positioning::leftbottom; i < positioning::null; ((int&)i)++) {
-			if (*(ptemp = root_node->get_dptr(i))) {
-				cur_nodes.push(*ptemp);
-				*ptemp = nullptr;
-			}
-		}
-		if (cur_nodes.size()) {
-			cur_node = cur_nodes.top();
-			cur_nodes.pop();
-		}
-		else
-			return;
-		while (true) {
-			if (cur_node) {
-				if (cur_node->particles_count_in_subtrees) {
-					for (positioning i = positioning::leftbottom; i < positioning::null; ((int&)i)++) {
-						if (*(ptemp = cur_node->get_dptr(i))) {
-							cur_nodes.push(*ptemp);
-						}
-					}
-				}
-			}
-			if (cur_nodes.size()) {
-				//cur_node->zero_pointers();
-				delete cur_node;
-				cur_node = cur_nodes.top();
-				cur_nodes.pop();
-			}
-			else
-				break;
-		}
+		root_node->zero_pointers();
 		root_node->particles_count_in_subtrees = 0;
 		root_node->mass_center = particle();
+		top_arena.reset();
+		for (auto& arena : cell_arenas)
+			arena.reset();
 		locker.unlock();
 	}
 
+	//the arenas go along with the nodes
 	inline void swap(quad_tree &tree) {
 		swap_prevention.lock();
 		tree.swap_prevention.lock();
@@ -387,6 +415,8 @@ struct quad_tree {
 		tree.locker.lock();
 
 		std::swap(root_node,tree.root_node);
+		std::swap(top_arena, tree.top_arena);
+		cell_arenas.swap(tree.cell_arenas);
 		
 		tree.locker.unlock();
 		locker.unlock();
@@ -394,19 +424,31 @@ struct quad_tree {
 		swap_prevention.unlock();
 	}
 
-	inline node** push(const particle& prt, unsigned char level = 0) {
+	inline node** push(const particle& prt) {
+		locker.lock();
+		node** temp = push_unlocked(prt);
+		locker.unlock();
+		return temp;
+	}
+
+	//for a tree nobody else touches, or with locker already taken
+	inline node** push_unlocked(const particle& prt) {
+		return push_from(root_node, prt, 0, top_arena);
+	}
+
+	//inserts into the subtree of nd, which is at depth level, new nodes are taken from arena
+	inline node** push_from(node* nd, const particle& prt, unsigned char level, node_arena& arena) {
 		constexpr unsigned char max_level = 50;
 		using namespace grav_eq_utils;
 		node::positioning prt_pos = node::positioning::null; 
 		node** temp = nullptr;
-		locker.lock();
-		node* nd = root_node;
 	prp_begining:
 		if (!nd || !nd->point_is_inside(prt.position)) 
 			goto prp_ending;
 
+		//only a leaf takes in a particle at the same place, the running mass center of an inner node depends on the push order
 		if (std::abs(nd->mass_center.mass) <= epsilon || 
-			(nd->mass_center.position - prt.position).norma2() < epsilon * epsilon || 
+			(!nd->particles_count_in_subtrees && (nd->mass_center.position - prt.position).norma2() < epsilon * epsilon) || 
 			level >= max_level) {
 			nd->mass_center += prt;
 			goto prp_ending;
@@ -416,7 +458,7 @@ struct quad_tree {
 			node::positioning mc_pos = node::get_positioning(nd, nd->mass_center.position);
 			node** temp = nd->get_dptr(mc_pos);
 			if (!*temp) {
-				*temp = new node(nd, mc_pos);
+				*temp = arena.make(nd, mc_pos);
 				(*temp)->mass_center = nd->mass_center;
 				nd->particles_count_in_subtrees++;
 			}
@@ -427,120 +469,172 @@ struct quad_tree {
 		prt_pos = node::get_positioning(nd, prt.position);
 		temp = nd->get_dptr(prt_pos);
 		if (!*temp) 
-			*temp = new node(nd, prt_pos);
+			*temp = arena.make(nd, prt_pos);
 		nd = *temp;
 		level++;
 		goto prp_begining;
 	prp_ending:
-		locker.unlock();
 		return temp;
 	}
 
-	inline void draw(int draw_level, const point& center, double side_size, float points_size, float value_decrimemnt, draw_type::dt type = draw_type::dt::density, bool extra_flare = false, bool edge_drawer = false, bool draw_points = false, bool extended_draw = false) {
-		swap_prevention.lock();
-		std::stack <pair<node*,int>> cur_nodes;
-		point	lb_sc{ (0 - RANGE) * (WindX / WINDXSIZE) - centx, (0 - RANGE) * (WindY / WINDYSIZE) - centy}, 
-				rt_sc{ { ( RANGE) * (WindX / WINDXSIZE) - centx, (RANGE) * (WindY / WINDYSIZE) - centy} };
-		pair<node*, int> cur_node = { root_node , 0 };
-		node* temp = nullptr;
-		double size = (_x(root_node->righttop_corner) - _x(root_node->leftbottom_corner));
-		side_size /= size;
-		while (true) {
-			if (cur_node.first) {
-				if (cur_node.second<draw_level && cur_node.first->particles_count_in_subtrees 
-					// && cur_node.first->righttop_corner >= lb_sc && cur_node.first->leftbottom_corner <= rt_sc // positioning on screen
-					) {
-					for (positioning i = positioning::leftbottom; i < positioning::null; ((int&)i)++) {
-						if ((temp = cur_node.first->get(i))) {
-							cur_nodes.push({ temp, cur_node.second + 1 });
-						}
-					}
-				}
-				else {
-					point lb = (cur_node.first->leftbottom_corner * side_size + center);
-					point rt = (cur_node.first->righttop_corner * side_size + center);
-					double particle_value = 0;
-					double node_value = 0;
-					double ratio = (cur_node.first->mass_center.radius * cur_node.first->mass_center.radius) / std::pow(_x(cur_node.first->leftbottom_corner - cur_node.first->righttop_corner), 2);
-					bool visited = cur_node.first->mass_center.visited;
-					auto position = (cur_node.first->mass_center.position * side_size + center);
-					switch (type) {
-					case draw_type::dt::density: // std::pow(_x(cur_node.first->leftbottom_corner - cur_node.first->righttop_corner), 2)
-						particle_value = cur_node.first->mass_center.mass / (cur_node.first->mass_center.radius);
-						node_value = particle_value * ratio;
-						break;
-					case draw_type::dt::energy:
-						particle_value = cur_node.first->mass_center.energy;
-						node_value = particle_value * ratio;
-						break;
-					case draw_type::dt::x_speed:
-						particle_value = cur_node.first->mass_center.velocity[0];
-						node_value = particle_value * ratio;
-						break;
-					case draw_type::dt::y_speed:
-						particle_value = cur_node.first->mass_center.velocity[1];
-						node_value = particle_value * ratio;
-						break;
-					case draw_type::dt::x_acceleration:
-						particle_value = cur_node.first->mass_center.acceleration[0];
-						node_value = particle_value * ratio;
-						break;
-					case draw_type::dt::y_acceleration:
-						particle_value = cur_node.first->mass_center.acceleration[1];
-						node_value = particle_value * ratio;
-						break;
-					} 
-					auto [nr, ng, nb] = get_color(node_value * value_decrimemnt);
-
-					if(edge_drawer){
-						glBegin(GL_LINE_LOOP);
-						glColor4f(nr, ng, nb, 1);
-						glVertex2f(_x(lb), _y(lb));
-						glVertex2f(_x(lb), _y(rt));
-						glVertex2f(_x(rt), _y(rt));
-						glVertex2f(_x(rt), _y(lb));
-						glEnd();
-					}
-					if(extended_draw){
-						draw_smooth_circle(_x(position), _y(position), 
-							cur_node.first->mass_center.radius*side_size, 
-							particle_value * value_decrimemnt,
-							1.10, 60
-						);
-					}
-					else {
-						auto [pr, pg, pb] = get_color(particle_value * value_decrimemnt);
-						auto a = (pr + pg + pb) * 0.15;
-
-						glPointSize(side_size * 2 * cur_node.first->mass_center.radius);
-						glColor4f(pr, pg, pb, 0.05 + 0.05 * visited + a);
-						glBegin(GL_POINTS);
-						glVertex2f(_x(position), _y(position));
-						glEnd();
-					}
-					
-					if (draw_points) {
-						glPointSize(points_size + extra_flare * points_size);
-						glColor4f(0.5 + extra_flare * visited, 0.5 - extra_flare * visited, 0.5 + 0.5 * visited, 0.5);
-						glBegin(GL_POINTS);
-						glVertex2f(_x(position), _y(position));
-						glEnd();
-					}
-				}
+	//parallel build, in three phases:
+	//build_skeleton makes every node of the top levels of an empty tree, the ones at the last level are the cells;
+	//then every cell can be filled with push_into_cell by its own thread, cells are disjoint so nothing is locked;
+	//link_cells drops the empty skeleton nodes and sums the moments of the top levels bottom-up.
+	int top_levels = 0;
+	std::vector<node*> cells;
+
+	inline void build_skeleton(int levels) {
+		top_levels = levels;
+		cells.assign(1, root_node);
+		for (int level = 0; level < levels; level++) {
+			std::vector<node*> next_cells;
+			for (auto cell : cells)
+				for (positioning i = positioning::leftbottom; i < positioning::null; ((int&)i)++)
+					next_cells.push_back(top_arena.make(cell, i));
+			cells.swap(next_cells);
+		}
+		cell_arenas.resize(cells.size());
+	}
+
+	//index in cells, -1 if outside of the tree
+	inline int cell_of(const point& pos) {
+		node* nd = root_node;
+		int cell = 0;
+		for (int level = 0; level < top_levels; level++) {
+			positioning pos_id = node::get_positioning(nd, pos);
+			if (pos_id == positioning::null)
+				return -1;
+			cell = cell * 4 + (int)pos_id;
+			nd = nd->get(pos_id);
+		}
+		return node::get_positioning(nd, pos) == positioning::null ? -1 : cell;
+	}
+
+	inline void push_into_cell(int cell, const particle& prt) {
+		push_from(cells[cell], prt, top_levels, cell_arenas[cell]);
+	}
+
+	//once a cell has all of its particles: the moments of its inner nodes are summed again from the leaves,
+	//always in the same order, so the tree does not depend on the order particles came in (worker count, stealing, restarts)
+	inline void sum_cell(int cell) {
+		sum_subtree(cells[cell]);
+	}
+	inline void sum_subtree(node* nd) {
+		if (!nd->particles_count_in_subtrees)
+			return;
+		particle sum;
+		bool is_first = true;
+		for (positioning i = positioning::leftbottom; i < positioning::null; ((int&)i)++) {
+			node* child = nd->get(i);
+			if (!child)
+				continue;
+			sum_subtree(child);
+			sum = is_first ? child->mass_center : sum + child->mass_center;
+			is_first = false;
+		}
+		nd->mass_center = sum;
+	}
+
+	inline void link_cells() {
+		link_node(root_node, 0);
+		cells.clear();
+		top_levels = 0;
+	}
+
+	//the three phases for a whole particle set into an empty tree, on threads_count threads of its own:
+	//the input is binned by cell in contiguous ranges, then the cells are filled one thread each,
+	//every cell takes its particles in input order whatever the thread count
+	inline void build(const std::vector<particle>& input, int levels, size_t threads_count) {
+		threads_count = max<size_t>(threads_count, 1);
+		auto run_on_threads = [&](auto function) {
+			std::vector<std::thread> threads;
+			for (size_t t = 1; t < threads_count; t++)
+				threads.emplace_back(function, t);
+			function(0);
+			for (auto& thread : threads)
+				thread.join();
+		};
+
+		build_skeleton(levels);
+		std::vector<std::vector<std::vector<uint32_t>>> bins(threads_count, std::vector<std::vector<uint32_t>>(cells.size()));
+		run_on_threads([&](size_t t) {
+			for (size_t i = input.size() * t / threads_count; i < input.size() * (t + 1) / threads_count; i++) {
+				int cell = cell_of(input[i].position);
+				if (cell >= 0)
+					bins[t][cell].push_back((uint32_t)i);
 			}
-			if (cur_nodes.size()) {
-				cur_node = cur_nodes.top();
-				cur_nodes.pop();
+		});
+		std::atomic<size_t> next_cell(0);
+		run_on_threads([&](size_t) {
+			for (size_t cell; (cell = next_cell++) < cells.size();) {
+				for (auto& bin : bins)
+					for (auto i : bin[cell])
+						push_into_cell((int)cell, input[i]);
+				sum_cell((int)cell);
 			}
-			else
-				break;
+		});
+		link_cells();
+	}
+
+	//the same structure a sequential push would give: no empty nodes, a node holding one particle is a leaf.
+	//dropped nodes stay in their arena until the next clear
+	inline void link_node(node* nd, int level) {
+		using namespace grav_eq_utils;
+		if (level == top_levels)
+			return;
+		node** ptemp;
+		node** only_child = nullptr;
+		int count = 0;
+		particle sum;
+		for (positioning i = positioning::leftbottom; i < positioning::null; ((int&)i)++) {
+			if (!*(ptemp = nd->get_dptr(i)))
+				continue;
+			node* child = *ptemp;
+			link_node(child, level + 1);
+			if (!child->particles_count_in_subtrees && std::abs(child->mass_center.mass) <= epsilon) {
+				*ptemp = nullptr;
+				continue;
+			}
+			sum = (count) ? sum + child->mass_center : child->mass_center;
+			count += (child->particles_count_in_subtrees) ? child->particles_count_in_subtrees : 1;
+			only_child = ptemp;
+		}
+		if (count == 1) {
+			nd->mass_center = (*only_child)->mass_center;
+			*only_child = nullptr;
+			nd->particles_count_in_subtrees = 0;
+		}
+		else {
+			if (count)
+				nd->mass_center = sum;
+			nd->particles_count_in_subtrees = count;
+		}
+	}
+
+	//every particle (leaf) of the tree, in no particular order
+	template<typename F>
+	inline void for_each_particle(F function) const {
+		std::stack<const node*> cur_nodes;
+		cur_nodes.push(root_node);
+		while (cur_nodes.size()) {
+			const node* cur_node = cur_nodes.top();
+			cur_nodes.pop();
+			if (cur_node->particles_count_in_subtrees) {
+				for (const node* child : { cur_node->left_bottom, cur_node->left_top, cur_node->right_top, cur_node->right_bottom })
+					if (child)
+						cur_nodes.push(child);
+			}
+			else if (std::abs(cur_node->mass_center.mass) > grav_eq_utils::epsilon)
+				function(cur_node->mass_center);
 		}
-		swap_prevention.unlock();
 	}
 };
 
 using vecnode = std::vector<node*>;
 
+//sleeps on a condition variable until signed, runs exec_func, then falls back to default_state.
+//waiting as the default state makes it run exec_func over and over until disabled.
 class pooled_thread {
 public:
 	enum class state {
@@ -549,137 +643,284 @@ public:
 private:
 	using funcT = std::function<void(void**)>;
 	void* thread_data;//memory leak is allowed actually
-	int await_in_milliseconds;
 	funcT exec_func;
 	bool is_active;
 	mutable state cur_state;
 	mutable state default_state;
-	std::recursive_mutex execution_locker;
+	std::mutex execution_locker;
+	std::condition_variable wakeup;
+	std::thread worker;
 	void start_thread() {
-		std::thread th([this]() {
-			while (is_active) {
-				execution_locker.lock();
-				if (cur_state == state::waiting) {
-					cur_state = state::running;
-					exec_func(&thread_data);
-				}
+		worker = std::thread([this]() {
+			std::unique_lock<std::mutex> lock(execution_locker);
+			while (true) {
+				wakeup.wait(lock, [this]() { return cur_state == state::waiting || !is_active; });
+				if (!is_active)
+					break;
+				cur_state = state::running;
+				lock.unlock();
+				exec_func(&thread_data);
+				lock.lock();
 				cur_state = default_state;
-				execution_locker.unlock();
-				std::this_thread::sleep_for(std::chrono::milliseconds(await_in_milliseconds));
 			}
 			});
-		th.detach();
 	}
 public:
-	pooled_thread(funcT function = [](void** ptr) {return; }, int awaiting_time = 5) :exec_func(function),  await_in_milliseconds(awaiting_time), default_state(state::idle) {
+	pooled_thread(funcT function = [](void** ptr) {return; }) :exec_func(function), default_state(state::idle) {
 		thread_data = nullptr;
 		is_active = true;
-		default_state = state::idle;
+		cur_state = state::idle;
 		start_thread();
 	}
 	~pooled_thread() {
 		disable();
+		join();
 	}
-	state get_state() const {
+	state get_state() {
+		std::lock_guard<std::mutex> lock(execution_locker);
 		return cur_state;
 	}
 	void sign_awaiting() {
-		execution_locker.lock();
-		cur_state = state::waiting;
-		execution_locker.unlock();
-	}
-	void set_new_awaiting_time(int milliseconds) {
-		execution_locker.lock();
-		await_in_milliseconds = milliseconds;
-		execution_locker.unlock();
+		{
+			std::lock_guard<std::mutex> lock(execution_locker);
+			cur_state = state::waiting;
+		}
+		wakeup.notify_one();
 	}
 	void set_new_default_state(state def_state = state::idle) {
-		execution_locker.lock();
+		std::lock_guard<std::mutex> lock(execution_locker);
 		default_state = def_state;
-		execution_locker.unlock();
 	}
+	//only while the thread is not running
 	void set_new_function(funcT func) {
-		execution_locker.lock();
+		std::lock_guard<std::mutex> lock(execution_locker);
 		exec_func = func;
-		execution_locker.unlock();
 	}
+	//the thread exits after the current exec_func returns; safe to call from exec_func itself
 	void disable() {
-		execution_locker.lock();
-		is_active = false;
-		execution_locker.unlock();
+		{
+			std::lock_guard<std::mutex> lock(execution_locker);
+			is_active = false;
+		}
+		wakeup.notify_one();
+	}
+	void join() {
+		if (worker.joinable() && worker.get_id() != std::this_thread::get_id())
+			worker.join();
 	}
 	void** __void_ptr_accsess() {
 		return &thread_data;
 	}
 };
 
+//all workers meet here at the end of a step, the last one to arrive runs on_step_end before anybody is released
+class step_barrier {
+	std::mutex locker;
+	std::condition_variable released;
+	const size_t expected;
+	size_t arrived;
+	size_t generation;
+	std::function<void()> on_step_end;
+public:
+	step_barrier(size_t expected, std::function<void()> on_step_end) :
+		expected(expected), arrived(0), generation(0), on_step_end(on_step_end) {}
+	void arrive_and_wait() {
+		std::unique_lock<std::mutex> lock(locker);
+		size_t current_generation = generation;
+		if (++arrived == expected) {
+			on_step_end();
+			arrived = 0;
+			generation++;
+			lock.unlock();
+			released.notify_all();
+		}
+		else
+			released.wait(lock, [&]() { return generation != current_generation; });
+	}
+};
+
+//the particles of a step as flat arrays, one entry per particle in the same order in every column
+struct particle_columns {
+	std::vector<double> x, y, vx, vy, mass, radius, density, energy;
+
+	inline size_t size() const {
+		return x.size();
+	}
+	inline void resize(size_t count) {
+		for (auto column : { &x, &y, &vx, &vy, &mass, &radius, &density, &energy })
+			column->resize(count);
+	}
+	inline void set(size_t i, const particle& prt) {
+		x[i] = prt.position[0];
+		y[i] = prt.position[1];
+		vx[i] = prt.velocity[0];
+		vy[i] = prt.velocity[1];
+		mass[i] = prt.mass;
+		radius[i] = prt.radius;
+		density[i] = prt.density;
+		energy[i] = prt.energy;
+	}
+	//the particles of a tree, in its walking order
+	inline void gather(const quad_tree& tree) {
+		size_t count = 0;
+		tree.for_each_particle([&](const particle&) { count++; });
+		resize(count);
+		size_t row = 0;
+		tree.for_each_particle([&](const particle& prt) { set(row++, prt); });
+	}
+};
+
+//what readers (the renderer, analysis, writers) get: the tree at the end of a step.
+//a published tree is not written again while anybody holds it, apart from the density and energy caches,
+//which are scratch of the processor and are not a part of the state
+struct state_snapshot {
+	std::shared_ptr<const quad_tree> tree;
+	//null unless the processor was asked for them with enable_columns()
+	std::shared_ptr<const particle_columns> columns;
+	size_t step;
+	double time;
+};
+
 struct grav_eq_processor {
-	mutable std::vector<vecnode> threads_desired_roots;
-	mutable std::stack <pair<node*, int>> _subdivision_cur_nodes;
-	mutable std::vector<std::pair<int, node*>> _subdivision_roots;
+	mutable std::stack <node*> _subdivision_cur_nodes;
+	//particle leaves of the current tree in hilbert order, and prefix sums of their costs
+	mutable std::vector<std::pair<uint32_t, node*>> _hilbert_leaves;
+	mutable std::vector<double> _hilbert_prefix_cost;
 	mutable std::vector<pooled_thread*> threads;
+	step_barrier* step_sync;
 	const size_t num_of_threads;
+	//worker i runs on worker_cpus[i % size] when pinned, empty otherwise
+	std::vector<size_t> worker_cpus;
+	//workers whose pinning the system refused, they run wherever the scheduler puts them
+	std::atomic<size_t> failed_pins;
+	struct leaf_range {
+		size_t begin, end;
+	};
+	work_stealing::scheduler<leaf_range> tasks;
+	static constexpr int min_task_particles = 32;
+	double task_split_cost;
+	bool is_cost_measured;
 
 	double heat_capacity;
-	double polytropic_coef;
 	double time_step;
 	double local_time_step;
 	double total_time;
 	const double __size;
-	quad_tree current, buffer;
-	std::mutex buffer_mutex;
-	std::mutex pre_swap;
-	std::mutex pause;
+	std::shared_ptr<quad_tree> current, buffer;
+	//trees which have been published and may still be read, reused once the processor holds the only reference
+	std::vector<std::shared_ptr<quad_tree>> retired_trees;
+	//read and replaced with std::atomic_load/atomic_store only
+	std::shared_ptr<const state_snapshot> published;
+	//columns of the step in flight, filled by the workers from their outputs; recycled the same way as trees
+	bool is_publishing_columns;
+	std::shared_ptr<particle_columns> next_columns;
+	std::vector<std::shared_ptr<particle_columns>> retired_columns;
+	//called with every new snapshot by the thread which finished the step, the workers wait for it to return
+	std::function<void(const std::shared_ptr<const state_snapshot>&)> on_publish;
+	//updated particles of every worker, the next tree is built from them once the step is over
+	std::vector<std::vector<particle>> worker_output;
+	//per worker and per cell of the next tree: indices into its worker_output
+	std::vector<std::vector<std::vector<uint32_t>>> worker_bins;
+	static constexpr int tree_build_levels = 3;
+	std::atomic<size_t> next_cell;
+	std::atomic<size_t> next_density_leaf;
+	std::atomic<size_t> next_energy_leaf;
+	step_barrier* phase_sync;
 	bool is_paused;
+
+	//step engine control, see step(), run_until(), pause() and resume()
+	static constexpr size_t unlimited_steps = std::numeric_limits<size_t>::max();
+	std::mutex control_locker;
+	std::condition_variable control_changed;
+	size_t steps_budget;
+	double time_limit;
+	size_t steps_done;
+	double step_end_time;
+	bool is_at_gate;
+	bool is_step_in_flight;
 	bool flickering;
 	bool reporting;
 	bool halt_velocity;
+	std::atomic<bool> is_stopping;
 
 #ifdef measuring_performance
 	std::chrono::high_resolution_clock::time_point last_iteration;
+	//seconds the workers waited for on_publish since the last report, i.e. backpressure of whatever consumes the steps
+	double publish_wait;
 #endif // performance_measuring
 
 
-	grav_eq_processor(const vector<particle>& input, double size) :
-		current(size),
-		buffer(size),
+	//two cpus are left to the UI by default
+	inline static size_t default_worker_count() {
+		size_t cpus = thread_affinity::cpu_count();
+		return (cpus > 2) ? cpus - 2 : 1;
+	}
+
+	grav_eq_processor(const vector<particle>& input, double size, size_t workers = 0, bool pin_workers = false) :
+		num_of_threads(workers ? workers : default_worker_count()),
+		worker_cpus(pin_workers ? thread_affinity::cpus_by_numa_node() : std::vector<size_t>()),
+		tasks(num_of_threads),
+		task_split_cost(0),
+		is_cost_measured(false),
 		heat_capacity(1.01),
-		polytropic_coef(1.67),
-		time_step(0.004), flickering(false), reporting(false), halt_velocity(false),
-		num_of_threads(max(std::thread::hardware_concurrency() - 2, 1)),
-		__size(size),
+		time_step(0.004),
 		local_time_step(time_step), 
-		total_time(0)
+		total_time(0),
+		__size(size),
+		current(std::make_shared<quad_tree>(size)),
+		buffer(std::make_shared<quad_tree>(size)),
+		is_publishing_columns(false),
+		worker_output(num_of_threads),
+		worker_bins(num_of_threads, std::vector<std::vector<uint32_t>>((size_t)1 << (2 * tree_build_levels))),
+		flickering(false), reporting(false), halt_velocity(false)
 #ifdef measuring_performance
 		, last_iteration(std::chrono::high_resolution_clock::now())
+		, publish_wait(0)
 #endif
 	{
 		is_paused = false;
+		is_stopping = false;
+		step_sync = nullptr;
+		phase_sync = nullptr;
+		next_cell = next_density_leaf = next_energy_leaf = 0;
+		failed_pins = 0;
+		steps_budget = unlimited_steps;
+		time_limit = std::numeric_limits<double>::infinity();
+		steps_done = 0;
+		step_end_time = 0;
+		is_at_gate = false;
+		is_step_in_flight = false;
+
+		build_initial_tree(input);
+		publish();
+	}
 
-		for (int i = 0; i < num_of_threads; i++)
-			threads_desired_roots.push_back(std::vector<node*>());
-
-		for (auto& prt : input) 
-			current.push(prt);
+	//the same way the workers build every next tree, so a restart from a checkpoint gets the very same one
+	inline void build_initial_tree(const vector<particle>& input) {
+		constexpr size_t min_particles_per_thread = 1 << 16;
+		current->build(input, tree_build_levels, max<size_t>(min<size_t>(num_of_threads, input.size() / min_particles_per_thread), 1));
 	}
 
 	inline static double get_density_at(node* begin, vecnode& reserved_rad_nodes, particle* rsv_part = nullptr) {
 		particle source = (rsv_part) ? *rsv_part : begin->mass_center;
 		radius_node_catcher(begin, source.radius, &reserved_rad_nodes, (rsv_part) ? &rsv_part->position : nullptr);
+		const grav_eq_utils::kernel_scale source_scale(source.radius);
 		double sum = 0;
 		for (auto& cur_node : reserved_rad_nodes) {
 			auto pos_difference = source.position - cur_node->mass_center.position;
 			auto max_radius = max(source.radius, cur_node->mass_center.radius);
 			if (is_beyond_radius(pos_difference, max_radius))
 				continue;
-			sum += cur_node->mass_center.mass * grav_eq_utils::pressure_core(pos_difference, max_radius);
+			sum += cur_node->mass_center.mass * grav_eq_utils::pressure_core(pos_difference, pair_scale(source_scale, max_radius));
 		}
 		return sum;
 	}
 
-	inline static double get_energy_at(node* begin, vecnode& reserved_rad_nodes, vecnode& reserved_drn, particle* rsv_part = nullptr) {
+	//needs the density caches of the current tree
+	inline static double get_energy_at(node* begin, vecnode& reserved_rad_nodes, particle* rsv_part = nullptr) {
 		particle source = (rsv_part) ? *rsv_part : begin->mass_center;
 		radius_node_catcher(begin, source.radius, &reserved_rad_nodes, (rsv_part) ? &rsv_part->position : nullptr);
+		const grav_eq_utils::kernel_scale source_scale(source.radius);
 		double sum = 0;
 		for (auto& cur_node : reserved_rad_nodes) {
 			auto pos_difference = source.position - cur_node->mass_center.position;
@@ -687,8 +928,8 @@ struct grav_eq_processor {
 			if (is_beyond_radius(pos_difference, max_radius))
 				continue;
 			sum += 
-				(cur_node->mass_center.mass / get_density_at(cur_node, reserved_drn))
-				* cur_node->mass_center.energy * grav_eq_utils::pressure_core(pos_difference, max_radius);
+				(cur_node->mass_center.mass / cur_node->density_cache)
+				* cur_node->mass_center.energy * grav_eq_utils::pressure_core(pos_difference, pair_scale(source_scale, max_radius));
 		}
 		return sum;
 	}
@@ -734,13 +975,16 @@ struct grav_eq_processor {
 		return gravitational_force;
 	}
 
-	inline static double get_pressure(double density, double energy, double polytropic_coef, double heat_capacity) {
-		constexpr double big_C_coef = 8.3;
-		return (heat_capacity - 1) * density * energy + big_C_coef*(polytropic_coef / 3. + 1. - heat_capacity) * std::pow(std::abs(density), polytropic_coef / 3. + 1.);
+	inline static double get_pressure(double density, double energy, double heat_capacity) {
+		return grav_eq_utils::eos_type::pressure(density, energy, heat_capacity);
 	}
 	inline static bool is_beyond_radius(const point& dist, double radius) {
 		return (dist.norma2() > radius* radius);
 	}
+	//source scale is reused as long as the source has the bigger radius of the pair
+	inline static grav_eq_utils::kernel_scale pair_scale(const grav_eq_utils::kernel_scale& source_scale, double max_radius) {
+		return (max_radius == source_scale.h) ? source_scale : grav_eq_utils::kernel_scale(max_radius);
+	}
 
 	struct iteration_result {
 		point dV;
@@ -750,28 +994,39 @@ struct grav_eq_processor {
 		double dT_CFL;
 	};
 
-	inline iteration_result iterate_particle(particle& current_prt, vecnode* rad_vector, vecnode* corad_vector1, vecnode* corad_vector2,
-		const double heat_capacity, const double polytropic_coef, const double time_step) {
+	//solves the smoothing length of current_prt in place first, dR is the change
+	inline iteration_result iterate_particle(particle& current_prt, vecnode* rad_vector, vecnode* corad_vector1, grav_eq_utils::neighbour_batch* batch, grav_eq_utils::smoothing_solver* smoothing,
+		const double heat_capacity, const double time_step) {
 		constexpr double error_edge_squared = 0.05;
 		constexpr double courant_number = 0.3;
 		constexpr bool is_complete_SPH = true;
-		node* cur_node = current.root_node; 
+		constexpr double max_radius_growth = 1.5;
+		node* cur_node = current->root_node; 
 		int interactions_counter = 0;
 		corad_vector1->clear();
-		corad_vector2->clear();
 		double cur_density = 0;
 		double cur_energy = 0;
 		double cur_pressure = 0;
 
-		radius_node_catcher(cur_node, current_prt.radius, rad_vector, &current_prt.position);
+		//one over-sized candidate list: the smoothing length is solved on it, then it is reused by the pair loop
+		const double min_radius = grav_eq_utils::epsilon * __size * 0.1;
+		const double search_radius = max(current_prt.radius * max_radius_growth, min_radius);
+		radius_node_catcher(cur_node, search_radius, rad_vector, &current_prt.position);
+		smoothing->clear();
+		for (auto& it_node : *rad_vector) {
+			auto pos_difference = current_prt.position - it_node->mass_center.position;
+			if (pos_difference.norma2() >= grav_eq_utils::epsilon)
+				smoothing->push(pos_difference.norma());
+		}
+		double dR = smoothing->solve(current_prt.radius, min_radius, search_radius).h - current_prt.radius;
+		current_prt.radius += dR;
 
 		cur_density = get_density_at(cur_node, *corad_vector1, &current_prt);
-		cur_energy = get_energy_at(cur_node, *corad_vector1, *corad_vector2, &current_prt);
-		cur_pressure = get_pressure(cur_density, cur_energy, polytropic_coef, heat_capacity);
+		cur_energy = get_energy_at(cur_node, *corad_vector1, &current_prt);
+		cur_pressure = get_pressure(cur_density, cur_energy, heat_capacity);
 
 		point gravity = barnes_hutt_force_in_subtree(cur_node, current_prt, error_edge_squared);
 
-		double dR = 0;
 		double dE = 0;
 
 		double max_mu = 0;
@@ -780,53 +1035,30 @@ struct grav_eq_processor {
 		point dV = { 0,0 };
 		double nabla_velocity = 0;
 
-		auto mu = [&](const particle& prt) {
-			const point velocity_difference = (current_prt.velocity - prt.velocity);
-			const point position_difference = (current_prt.position - prt.position);
-			const double radius = max(current_prt.radius, prt.radius);
-			double prod = velocity_difference * position_difference;
-			double stabilizing_term = 0.01;
-			if (prod < 0)
-				return radius * prod / (
-					(position_difference.norma2() + stabilizing_term)
-				);
-			else
-				return 0.;
-		};
-
-		dR = current_prt.radius * (0.05 + 0.45*(is_complete_SPH)) * (1. + std::pow(particle::desired_amount_of_interactions / (current_prt.interactions_count + 1), 0.33333));
-		dR = max(dR, grav_eq_utils::epsilon * __size * 0.1);
-		dR -= current_prt.radius;
-
+		//neighbour state is gathered first, the pair terms are then summed by the batched kernel
+		batch->clear();
 		for (auto& it_node : *rad_vector) {
 			auto pos_difference = current_prt.position - it_node->mass_center.position;
 			auto vel_difference = current_prt.velocity - it_node->mass_center.velocity;
 			auto max_radius = max(current_prt.radius, it_node->mass_center.radius);
 			if (is_beyond_radius(pos_difference, max_radius) || pos_difference.norma2()<grav_eq_utils::epsilon || !is_complete_SPH)
 				continue;
-			auto inner_node_density = get_density_at(it_node, *corad_vector1);
-			auto inner_node_energy = get_energy_at(it_node, *corad_vector1, *corad_vector2);
-			auto inner_node_pressure = get_pressure(inner_node_density, inner_node_energy, polytropic_coef, heat_capacity);
-			auto core_gradient = grav_eq_utils::pressure_core_gradient(pos_difference, max_radius);
-
-			max_mu = max(max_mu, mu(it_node->mass_center));
-			nabla_velocity +=
-				it_node->mass_center.mass * vel_difference * core_gradient;
-
-			dV += it_node->mass_center.mass * (
-				inner_node_pressure / (inner_node_density * inner_node_density) +
-				cur_pressure / (cur_density * cur_density)
-				) * core_gradient;
-
-			dE +=
-				it_node->mass_center.mass * vel_difference * (
-					inner_node_pressure / (inner_node_density * inner_node_density) + 
-					cur_pressure / (cur_density*cur_density)
-				) * core_gradient;
+			auto inner_node_density = it_node->density_cache;
+			auto inner_node_energy = it_node->energy_cache;
+			auto inner_node_pressure = get_pressure(inner_node_density, inner_node_energy, heat_capacity);
+
+			batch->push(_x(pos_difference), _y(pos_difference), _x(vel_difference), _y(vel_difference),
+				it_node->mass_center.mass, max_radius, inner_node_pressure / (inner_node_density * inner_node_density));
 
 			interactions_counter++;
 		}
 
+		auto sums = sph_simd::accumulate<grav_eq_utils::kernel_type>(*batch, cur_pressure / (cur_density * cur_density), grav_eq_utils::epsilon);
+		dV = { sums.dvx, sums.dvy };
+		dE = sums.de;
+		nabla_velocity = sums.nabla_velocity;
+		max_mu = sums.max_mu;
+
 		nabla_velocity = -nabla_velocity / cur_density;
 		delta_time_CFL = min(sqrt(current_prt.radius / dV.norma()), 
 			min(courant_number * current_prt.radius / (current_prt.velocity.norma()),
@@ -839,19 +1071,20 @@ struct grav_eq_processor {
 		return { -dV + gravity, (dE), dR, interactions_counter, delta_time_CFL };
 	}
 
-	inline particle iterate_over_particle(particle& current_prt, vecnode* rad_vector, vecnode* corad_vector1, vecnode* corad_vector2,
-		const double heat_capacity, const double polytropic_coef, const double time_step) {// kind-of velvet integration
+	inline particle iterate_over_particle(particle& current_prt, vecnode* rad_vector, vecnode* corad_vector1, grav_eq_utils::neighbour_batch* batch, grav_eq_utils::smoothing_solver* smoothing,
+		const double heat_capacity, const double time_step) {// kind-of velvet integration
 		
+		auto begin = std::chrono::steady_clock::now();
 		particle local_prt = current_prt;
 		double time_elapsed = 0;
 		double local_time_step = time_step;
 #ifdef is_variable_timestep
 		double cfl_time = local_prt.cfl_time;
 #endif
-			auto ans = iterate_particle(local_prt, rad_vector, corad_vector1, corad_vector2, heat_capacity, polytropic_coef, local_time_step);
+			//both evaluations set local_prt.radius to the solved smoothing length
+			auto ans = iterate_particle(local_prt, rad_vector, corad_vector1, batch, smoothing, heat_capacity, local_time_step);
 			local_prt.energy += local_time_step * ans.dE;
 			local_prt.interactions_count = ans.interactions_count;
-			local_prt.radius += 0.5 * ans.dR;
 
 			point initial_vel = local_prt.velocity;
 			local_prt.position += local_time_step * (local_prt.velocity + local_time_step * (
@@ -859,13 +1092,9 @@ struct grav_eq_processor {
 				));
 			local_prt.velocity += local_time_step * (1.5 * ans.dV - 0.5 * local_prt.acceleration);
 
-			auto n_ans = iterate_particle(local_prt, rad_vector, corad_vector1, corad_vector2, polytropic_coef, heat_capacity, local_time_step);
+			auto n_ans = iterate_particle(local_prt, rad_vector, corad_vector1, batch, smoothing, heat_capacity, local_time_step);
 			//local_prt.energy += 0.25 * time_step * n_ans.dE;
 			local_prt.interactions_count = n_ans.interactions_count;
-			local_prt.radius = //min(
-				max(local_prt.radius + 0.5 * n_ans.dR, grav_eq_utils::epsilon)
-				//,50
-				;//);
 			local_prt.energy = 1 * local_time_step * (ans.dE);
 
 			local_prt.acceleration = (ans.dV + n_ans.dV) * 0.5;
@@ -875,70 +1104,79 @@ struct grav_eq_processor {
 #ifdef is_variable_timestep
 		local_prt.cfl_time = min(ans.dT_CFL, n_ans.dT_CFL);
 #endif
+		//averaged with the previous steps, a single preempted step should not move the partition much
+		auto spent = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+		local_prt.cost = (current_prt.cost > 0) ? 0.5 * (current_prt.cost + spent) : spent;
 		return local_prt;
 	}
 
-	inline void iterate_subtree(node* subtree_root, std::stack<node*>* cur_nodes, vecnode* rad_nodes, vecnode* first_corad, vecnode* second_corad) {
-		while (cur_nodes->size())
-			cur_nodes->pop();
-		node* cur_node = subtree_root;
-		node** ptemp;
-		while (true) {
-			if (cur_node) {
-				if (cur_node->particles_count_in_subtrees) {
-					for (node::positioning i = node::positioning::leftbottom; i < node::positioning::null; ((int&)i)++) {
-						if (*(ptemp = cur_node->get_dptr(i))) {
-							cur_nodes->push(*ptemp);
-						}
-					}
-				}
-				else {
-					if (std::abs(cur_node->mass_center.mass) > grav_eq_utils::epsilon && !cur_node->particles_count_in_subtrees) {
-						auto prt = iterate_over_particle(cur_node->mass_center, rad_nodes, first_corad, second_corad, heat_capacity, polytropic_coef, local_time_step);
-						cur_node->mass_center.visited = flickering;
-						if (prt.velocity[0] == prt.velocity[0] && prt.acceleration[0] == prt.acceleration[0]) {
-							if (!grav_eq_utils::point_in_square(buffer.root_node->leftbottom_corner, buffer.root_node->righttop_corner, prt.position)) {
-								prt.velocity = -1 * prt.velocity;
-								prt.position[0] = clamp(prt.position[0], buffer.root_node->leftbottom_corner[0], buffer.root_node->righttop_corner[0]);
-								prt.position[1] = clamp(prt.position[1], buffer.root_node->leftbottom_corner[1], buffer.root_node->righttop_corner[1]);
-							}
-							buffer_mutex.lock();
-							buffer.push(prt); 
-							buffer_mutex.unlock();
-						}
-						else
-							printf("nan detected\n");
-					}
-				}
+	inline void iterate_leaf(node* leaf, std::vector<particle>* output, vecnode* rad_nodes, vecnode* first_corad, grav_eq_utils::neighbour_batch* batch, grav_eq_utils::smoothing_solver* smoothing) {
+		auto prt = iterate_over_particle(leaf->mass_center, rad_nodes, first_corad, batch, smoothing, heat_capacity, local_time_step);
+		prt.visited = flickering;
+		prt.density = leaf->density_cache;
+		if (prt.velocity[0] == prt.velocity[0] && prt.acceleration[0] == prt.acceleration[0]) {
+			if (!grav_eq_utils::point_in_square(buffer->root_node->leftbottom_corner, buffer->root_node->righttop_corner, prt.position)) {
+				prt.velocity = -1 * prt.velocity;
+				prt.position[0] = clamp(prt.position[0], buffer->root_node->leftbottom_corner[0], buffer->root_node->righttop_corner[0]);
+				prt.position[1] = clamp(prt.position[1], buffer->root_node->leftbottom_corner[1], buffer->root_node->righttop_corner[1]);
 			}
-			if (cur_nodes->size()) {
-				cur_node->mass_center.visited = flickering;
-				cur_node = cur_nodes->top();
-				cur_nodes->pop();
-			}
-			else
-				break;
+			output->push_back(prt);
 		}
+		else
+			printf("nan detected\n");
 	}
 
-	inline void subdivide_tree() {
-		constexpr int catch_level = 5;
-		const double relation = (double)current.root_node->particles_count_in_subtrees / num_of_threads;
+	inline double range_cost(const leaf_range& range) const {
+		return _hilbert_prefix_cost[range.end] - _hilbert_prefix_cost[range.begin];
+	}
+
+	//first leaf of the upper half by cost, strictly inside of the range
+	inline size_t cost_midpoint(const leaf_range& range) const {
+		double half = 0.5 * (_hilbert_prefix_cost[range.begin] + _hilbert_prefix_cost[range.end]);
+		size_t middle = std::upper_bound(_hilbert_prefix_cost.begin() + range.begin + 1, _hilbert_prefix_cost.begin() + range.end, half) - _hilbert_prefix_cost.begin();
+		return clamp(middle, range.begin + 1, range.end - 1);
+	}
+
+	inline double leaf_cost(node* leaf) const {
+		return is_cost_measured ? leaf->mass_center.cost : 1.;
+	}
+
+	inline void bin_output(int id) {
+		auto& bins = worker_bins[id];
+		auto& output = worker_output[id];
+		for (auto& bin : bins)
+			bin.clear();
+		for (uint32_t i = 0; i < output.size(); i++) {
+			int cell = buffer->cell_of(output[i].position);
+			if (cell >= 0)
+				bins[cell].push_back(i);
+		}
+	}
+
+	inline void build_cells() {
+		size_t cell;
+		while ((cell = next_cell++) < buffer->cells.size()) {
+			for (size_t id = 0; id < num_of_threads; id++)
+				for (auto i : worker_bins[id][cell])
+					buffer->push_into_cell((int)cell, worker_output[id][i]);
+			buffer->sum_cell((int)cell);
+		}
+	}
 
-		int cur_thread_num = 0;
-		int cur_am_of_particles = 0;
-		pair<node*, int> cur_node = { current.root_node , 0 };
+	//orders the particle leaves along a hilbert curve and hands every worker a contiguous range of equal cost
+	inline void subdivide_tree() {
+		node* cur_node = current->root_node;
 		node* temp = nullptr;
 
-		_subdivision_roots.clear();
+		_hilbert_leaves.clear();
 		while (_subdivision_cur_nodes.size()) 
 			_subdivision_cur_nodes.pop();
 
-		printf("%i particles\n", current.root_node->particles_count_in_subtrees);
+		printf("%i particles\n", current->root_node->particles_count_in_subtrees);
 
 #ifdef is_variable_timestep
-		printf("cfl_time: %lf; total_time: %lf\n", current.root_node->mass_center.cfl_time, total_time);
-		local_time_step = min(current.root_node->mass_center.cfl_time, time_step);
+		printf("cfl_time: %lf; total_time: %lf\n", current->root_node->mass_center.cfl_time, total_time);
+		local_time_step = min(current->root_node->mass_center.cfl_time, time_step);
 #else
 		printf("total_time: %lf\n", total_time);
 		local_time_step = time_step;
@@ -949,23 +1187,22 @@ struct grav_eq_processor {
 		auto difference = std::chrono::duration_cast<std::chrono::duration<double>>(now - last_iteration);
 		last_iteration = now;
 		printf("Delta time: %lf\n", difference.count());
+		printf("Steals: %zu\n", tasks.take_steals());
+		printf("Publish wait: %lf\n", publish_wait);
+		publish_wait = 0;
 #endif // measuring_performance
 
 		while (true) {
-			if (cur_node.first) {
-				if (cur_node.second < catch_level && cur_node.first->particles_count_in_subtrees) {
+			if (cur_node) {
+				if (cur_node->particles_count_in_subtrees) {
 					for (quad_tree::positioning i = quad_tree::positioning::leftbottom; i < quad_tree::positioning::null; ((int&)i)++) {
-						if ((temp = cur_node.first->get(i))) {
-							_subdivision_cur_nodes.push({ temp, cur_node.second + 1 });
+						if ((temp = cur_node->get(i))) {
+							_subdivision_cur_nodes.push(temp);
 						}
 					}
 				}
-				else {
-					cur_am_of_particles += (!cur_node.first->particles_count_in_subtrees) + cur_node.first->particles_count_in_subtrees;
-					if (cur_am_of_particles / relation - 1 > cur_thread_num)
-						cur_thread_num++;
-					_subdivision_roots.push_back({ cur_thread_num, cur_node.first });
-				}
+				else if (std::abs(cur_node->mass_center.mass) > grav_eq_utils::epsilon)
+					_hilbert_leaves.push_back({ grav_eq_utils::hilbert_key(current->root_node->leftbottom_corner, current->root_node->righttop_corner, cur_node->mass_center.position), cur_node });
 			}
 			if (_subdivision_cur_nodes.size()) {
 				cur_node = _subdivision_cur_nodes.top();
@@ -974,81 +1211,322 @@ struct grav_eq_processor {
 			else
 				break;
 		}
+		std::sort(_hilbert_leaves.begin(), _hilbert_leaves.end(),
+			[](const std::pair<uint32_t, node*>& a, const std::pair<uint32_t, node*>& b) { return a.first < b.first; });
+
+		//split on the cost measured in the previous step, on particle counts until there is one
+		is_cost_measured = current->root_node->mass_center.cost > 0;
+		_hilbert_prefix_cost.assign(1, 0.);
+		for (auto& leaf : _hilbert_leaves)
+			_hilbert_prefix_cost.push_back(_hilbert_prefix_cost.back() + leaf_cost(leaf.second));
+		const double relation = _hilbert_prefix_cost.back() / num_of_threads;
+
+		//the cost split only seeds the deques, whatever is left unbalanced is stolen
+		task_split_cost = relation / 16;
+		size_t begin = 0;
+		for (size_t thread_num = 0; thread_num < num_of_threads; thread_num++) {
+			size_t end = (thread_num + 1 == num_of_threads) ? _hilbert_leaves.size() :
+				std::upper_bound(_hilbert_prefix_cost.begin() + begin, _hilbert_prefix_cost.end() - 1, relation * (thread_num + 1)) - _hilbert_prefix_cost.begin();
+			end = max(end, begin);
+			if (end > begin)
+				tasks.push(thread_num, { begin, end });
+			begin = end;
+		}
+	}
+	
+	template<typename F>
+	inline void for_each_leaf(std::atomic<size_t>& next_leaf, F function) {
+		constexpr size_t chunk = 64;
+		size_t begin;
+		while ((begin = next_leaf.fetch_add(chunk)) < _hilbert_leaves.size())
+			for (size_t i = begin; i < min(begin + chunk, _hilbert_leaves.size()); i++)
+				function(_hilbert_leaves[i].second);
+	}
 
-		for (auto& vec : threads_desired_roots)
-			vec.clear();
+	//the snapshot of the current tree, lock-free for the reader; it stays valid for as long as it is held
+	inline std::shared_ptr<const state_snapshot> snapshot() const {
+		return std::atomic_load(&published);
+	}
 
-		for (auto& root : _subdivision_roots)
-			threads_desired_roots[root.first].push_back(root.second);
+	inline std::shared_ptr<const state_snapshot> publish(std::shared_ptr<const particle_columns> columns = nullptr) {
+		auto snapshot = std::make_shared<const state_snapshot>(state_snapshot{ current, std::move(columns), steps_done, step_end_time });
+		std::atomic_store(&published, snapshot);
+		return snapshot;
 	}
-	
-	inline void start_threads() {
-		if (threads.size())
+
+	//published is the only way for a reader to get at a tree or columns, so once it points elsewhere
+	//a use count of one cannot go up again and the object is free to be rebuilt.
+	//use_count() is a relaxed load, so on its own it does not order the reader's last accesses before our writes.
+	//the reader lets go with a release decrement of the count (every standard library does it with acq_rel),
+	//the load reads that decrement or a later one of the same release sequence, and the acquire fence after it
+	//then synchronises with it: everything the reader did through its copy happens before the object is reused
+	template<typename T, typename F>
+	inline static std::shared_ptr<T> reclaim(std::vector<std::shared_ptr<T>>& retired, F make) {
+		for (auto it = retired.begin(); it != retired.end(); ++it) {
+			if (it->use_count() == 1) {
+				std::atomic_thread_fence(std::memory_order_acquire);
+				auto object = std::move(*it);
+				retired.erase(it);
+				return object;
+			}
+		}
+		return make();
+	}
+
+	inline std::shared_ptr<quad_tree> reclaim_tree() {
+		auto tree = reclaim(retired_trees, [this]() { return std::make_shared<quad_tree>(__size); });
+		tree->clear();
+		return tree;
+	}
+
+	//every snapshot from now on carries particle_columns, the current one is republished with them.
+	//not while a step is running: before start_threads() or while paused
+	inline void enable_columns() {
+		if (is_publishing_columns)
 			return;
+		is_publishing_columns = true;
+		auto columns = std::make_shared<particle_columns>();
+		size_t count = 0;
+		current->for_each_particle([&](const particle&) { count++; });
+		columns->resize(count);
+		count = 0;
+		current->for_each_particle([&](const particle& prt) { columns->set(count++, prt); });
+		retired_columns.push_back(columns);
+		publish(columns);
+		next_columns = std::make_shared<particle_columns>();
+	}
+
+	//for restarts: carry on with the step count and the simulated time of an earlier run.
+	//not while a step is running: before start_threads() or while paused
+	inline void set_clock(size_t step, double time) {
+		steps_done = step;
+		total_time = step_end_time = time;
+		publish(snapshot()->columns);
+	}
+
+	//the rows of worker id go after the ones of all the workers before it
+	inline void fill_columns(int id) {
+		size_t row = 0;
+		for (int i = 0; i < id; i++)
+			row += worker_output[i].size();
+		for (auto& prt : worker_output[id])
+			next_columns->set(row++, prt);
+	}
+
+	//swap phase, the workers are all at step_sync.
+	//the new tree is published, the old one is retired and usually comes right back as the next build buffer
+	inline void finish_step() {
+		buffer->link_cells();
+		size_t particles = 0;
+		for (auto& output : worker_output) {
+			particles += output.size();
+			output.clear();
+		}
+		retired_trees.push_back(std::move(current));
+		current = std::move(buffer);
+		step_end_time = total_time;
+		steps_done++;
+		std::shared_ptr<particle_columns> columns;
+		if (is_publishing_columns) {
+			next_columns->resize(particles);
+			retired_columns.push_back(next_columns);
+			columns = std::move(next_columns);
+		}
+		auto snapshot = publish(std::move(columns));
+		if (on_publish) {
+#ifdef measuring_performance
+			auto begin = std::chrono::high_resolution_clock::now();
+			on_publish(snapshot);
+			publish_wait += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count();
+#else
+			on_publish(snapshot);
+#endif
+		}
+		if (is_publishing_columns)
+			next_columns = reclaim(retired_columns, []() { return std::make_shared<particle_columns>(); });
+		buffer = reclaim_tree();
+		buffer->build_skeleton(tree_build_levels);
+		is_step_in_flight = false;
+	}
 
+	inline void begin_step() {
+		next_cell = next_density_leaf = next_energy_leaf = 0;
 		subdivide_tree();
-		for (int i = 0; i < num_of_threads; i++){
+		//no more rows than leaves, the surplus is cut off in finish_step
+		if (is_publishing_columns)
+			next_columns->resize(_hilbert_leaves.size());
+		is_step_in_flight = true;
+	}
+
+	//a step is: density, energy, forces (with the integration), rebuild, swap; phases are separated by barriers.
+	//the last worker at step_sync finishes the step and then holds everybody at the control gate
+	//until step(), run_until() or resume() lets the next one in
+	inline void start_threads(bool paused = false) {
+		if (threads.size())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(control_locker);
+			steps_budget = paused ? 0 : unlimited_steps;
+			time_limit = std::numeric_limits<double>::infinity();
+			is_paused = paused;
+		}
+		buffer->build_skeleton(tree_build_levels);
+		phase_sync = new step_barrier(num_of_threads, []() {});
+		step_sync = new step_barrier(num_of_threads, [this]() {
+			if (is_step_in_flight)
+				finish_step();
+
+			std::unique_lock<std::mutex> lock(control_locker);
+			is_at_gate = true;
+			control_changed.notify_all();
+			control_changed.wait(lock, [this]() { return is_stopping || (steps_budget && step_end_time < time_limit); });
+			is_at_gate = false;
+			if (is_stopping) {
+				for (auto ptr : threads)
+					ptr->disable();
+				return;
+			}
+			if (steps_budget != unlimited_steps)
+				steps_budget--;
+			lock.unlock();
+
+			begin_step();
+		});
+		for (size_t i = 0; i < num_of_threads; i++){
 			threads.push_back(new pooled_thread()); // executors
+			threads.back()->set_new_default_state(pooled_thread::state::waiting);
 			auto t = threads.back()->__void_ptr_accsess();
-			*t = (void*)i;
+			*t = (void*)(intptr_t)i;
 			threads.back()->set_new_function([this](void** void_ptr) {
 
 				typedef struct {
-					vecnode rad_nodes, first_corad, second_corad;
-					std::stack <node*> cur_nodes;
-					vecnode* root_ptrs;
+					vecnode rad_nodes, first_corad;
+					grav_eq_utils::neighbour_batch batch;
+					grav_eq_utils::smoothing_solver smoothing;
 					int id;
 				} thread_info;
 				thread_info** pptr = (thread_info**)void_ptr;
 
 				if (*pptr < (thread_info*)0x400) {
-					int id = (int)*pptr;
+					int id = (int)(intptr_t)*pptr;
+					//pinned before anything of its own is allocated, so all of it is first touched on its numa node
+					if (worker_cpus.size() && !thread_affinity::pin_current_thread(worker_cpus[id % worker_cpus.size()]))
+						failed_pins++;
 					*pptr = new thread_info;
-					(*pptr)->root_ptrs = &(threads_desired_roots[id]);
 					(*pptr)->id = id;
+					(*pptr)->smoothing.target = particle::desired_amount_of_interactions;
 				}
+				thread_info* info = *pptr;
 
-				pause.lock();
-				pause.unlock();
-
-				for (auto& local_root : *(*pptr)->root_ptrs)
-					iterate_subtree(local_root, &(*pptr)->cur_nodes, &(*pptr)->rad_nodes, &(*pptr)->first_corad, &(*pptr)->second_corad);
-
-				//printf("thread finished\n");
+				step_sync->arrive_and_wait();
+				if (is_stopping)
+					return;
+				//twice the fair share, so only a worker which steals a lot ever reallocates
+				worker_output[info->id].reserve(2 * _hilbert_leaves.size() / num_of_threads + min_task_particles);
+
+				//density and energy of every particle, neighbours read them instead of recomputing them
+				for_each_leaf(next_density_leaf, [&](node* leaf) { leaf->density_cache = get_density_at(leaf, info->rad_nodes); });
+				phase_sync->arrive_and_wait();
+				for_each_leaf(next_energy_leaf, [&](node* leaf) { leaf->energy_cache = get_energy_at(leaf, info->rad_nodes); });
+				phase_sync->arrive_and_wait();
+
+				//forces and integration, into worker_output
+				leaf_range task;
+				while (!tasks.finished()) {
+					if (!tasks.next(info->id, task)) {
+						std::this_thread::yield();
+						continue;
+					}
+					//heavy ranges are halved by cost, the upper halves are left in the deque to be stolen
+					while (task.end - task.begin > min_task_particles && range_cost(task) > task_split_cost) {
+						size_t middle = cost_midpoint(task);
+						tasks.push(info->id, { middle, task.end });
+						task.end = middle;
+					}
+					for (size_t i = task.begin; i < task.end; i++)
+						iterate_leaf(_hilbert_leaves[i].second, &worker_output[info->id], &info->rad_nodes, &info->first_corad, &info->batch, &info->smoothing);
+					tasks.done();
+				}
 
+				//rebuild: every worker bins its own particles, then cells of the next tree are built in parallel
+				bin_output(info->id);
+				phase_sync->arrive_and_wait();
+				if (is_publishing_columns)
+					fill_columns(info->id);
+				build_cells();
 			});
 			threads.back()->sign_awaiting();
 		}
+	}
 
-		Sleep(5);
-
-		threads.push_back(new pooled_thread());//observer
-		threads.back()->set_new_awaiting_time(10);
-		threads.back()->set_new_default_state(pooled_thread::state::waiting);
-		threads.back()->set_new_function([this](void** ptr) {
-			for (auto ptr : threads)
-				if (ptr != threads.back() && ptr->get_state() != pooled_thread::state::idle) {
-					threads.back()->sign_awaiting();
-					return;
-				}
-
-			//printf("not subdivided\n");
+	//lets n more steps run and waits until they are done
+	inline void step(size_t n = 1) {
+		if (!threads.size())
+			return;
+		std::unique_lock<std::mutex> lock(control_locker);
+		steps_budget = n;
+		time_limit = std::numeric_limits<double>::infinity();
+		is_paused = true;
+		control_changed.notify_all();
+		control_changed.wait(lock, [this]() { return is_stopping || (is_at_gate && !steps_budget); });
+	}
 
-			pause.lock();
-			pause.unlock();
-			pre_swap.lock();
-			current.clear();
-			current.swap(buffer);
-			pre_swap.unlock();
+	//runs steps until the simulated time reaches t, then stays paused
+	inline void run_until(double t) {
+		if (!threads.size())
+			return;
+		std::unique_lock<std::mutex> lock(control_locker);
+		steps_budget = unlimited_steps;
+		time_limit = t;
+		is_paused = true;
+		control_changed.notify_all();
+		control_changed.wait(lock, [this]() { return is_stopping || (is_at_gate && step_end_time >= time_limit); });
+		steps_budget = 0;
+	}
 
-			subdivide_tree();
+	//the step in flight is finished, nothing waits for it
+	inline void pause() {
+		std::lock_guard<std::mutex> lock(control_locker);
+		steps_budget = 0;
+		is_paused = true;
+	}
 
-			for (auto ptr : threads)
-				ptr->sign_awaiting();
+	inline void resume() {
+		{
+			std::lock_guard<std::mutex> lock(control_locker);
+			steps_budget = unlimited_steps;
+			time_limit = std::numeric_limits<double>::infinity();
+			is_paused = false;
+		}
+		control_changed.notify_all();
+	}
 
-			//printf("subdivided\n");
+	//finishes the step in flight and joins the workers
+	inline void stop_threads() {
+		if (!threads.size())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(control_locker);
+			is_stopping = true;
+		}
+		control_changed.notify_all();
+		for (auto ptr : threads) {
+			ptr->join();
+			delete ptr;
+		}
+		threads.clear();
+		//drops the empty skeleton left for the step which never ran
+		buffer->link_cells();
+		delete step_sync;
+		step_sync = nullptr;
+		delete phase_sync;
+		phase_sync = nullptr;
+		is_stopping = false;
+	}
 
-		});
-		threads.back()->sign_awaiting();
+	~grav_eq_processor() {
+		stop_threads();
 	}
+
 };
\ No newline at end of file
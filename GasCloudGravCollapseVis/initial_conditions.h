@@ -0,0 +1,259 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "counter_rng.h"
+#include "grav_eq_iterator.h"
+#include "scalar_field.h"
+
+//initial particle sets. every particle draws from a counter_rng stream of its own (seed, index),
+//so the generators run on any number of threads and give the same particles for the same seed
+namespace initial_conditions {
+	struct cloud {
+		size_t amount = 1280;
+		uint64_t seed = 1;
+		double mass = 100;//of every particle
+		double radius = 0.1;//smoothing radius, unless neighbours is set
+		size_t neighbours = 10;//radius from the distance to this many neighbours, see smoothing_from_density; 0 keeps radius
+		size_t workers = 0;//0 is all cpus
+	};
+
+	//radius of the disc the viewer starts from, in a square of side size
+	inline double viewer_disc_radius(double size) {
+		return 0.75 * size / 1.535;
+	}
+
+	//function(begin, end) over contiguous parts of [0, count), one per thread
+	template<typename F>
+	inline void parallel_for(size_t count, size_t workers, F function) {
+		if (!workers)
+			workers = max<size_t>(std::thread::hardware_concurrency(), 1);
+		workers = max<size_t>(min<size_t>(workers, count), 1);
+		std::vector<std::thread> threads;
+		for (size_t w = 1; w < workers; w++)
+			threads.emplace_back(function, count * w / workers, count * (w + 1) / workers);
+		function(0, count / workers);
+		for (auto& thread : threads)
+			thread.join();
+	}
+
+	//sum of value(i) over [0, count) in fixed blocks added in order, so it does not depend on the threads
+	template<typename T, typename F>
+	inline T parallel_sum(size_t count, size_t workers, F value) {
+		constexpr size_t block = 1 << 16;
+		std::vector<T> sums((count + block - 1) / block, T());
+		parallel_for(sums.size(), workers, [&](size_t begin, size_t end) {
+			for (size_t b = begin; b < end; b++)
+				for (size_t i = b * block; i < min<size_t>(count, (b + 1) * block); i++)
+					sums[b] += value(i);
+		});
+		T sum = T();
+		for (auto& part : sums)
+			sum += part;
+		return sum;
+	}
+
+	//radius = distance to the neighbours-th nearest other particle, the neighbour number the step aims at.
+	//searched in an implicit kd-tree: a range of particle indices is split at its median, x and y in turn,
+	//the median stays in the middle and the halves on both sides of it are split the same way down to small
+	//leaves. a range and its depth give the split, so there are no nodes to store
+	inline void smoothing_from_density(std::vector<particle>& particles, size_t neighbours = 10, size_t workers = 0) {
+		if (!neighbours || particles.size() <= neighbours)
+			return;
+		constexpr size_t leaf_size = 16;
+		std::vector<uint32_t> order(particles.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = (uint32_t)i;
+
+		//the first levels are split on threads of their own
+		size_t spawn_levels = 0;
+		for (size_t threads = workers ? workers : std::thread::hardware_concurrency(); threads > 1; threads /= 2)
+			spawn_levels++;
+		std::function<void(size_t, size_t, size_t)> build = [&](size_t begin, size_t end, size_t depth) {
+			if (end - begin <= leaf_size)
+				return;
+			size_t mid = (begin + end) / 2, axis = depth & 1;
+			std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+				[&](uint32_t l, uint32_t r) { return particles[l].position[axis] < particles[r].position[axis]; });
+			if (depth < spawn_levels) {
+				std::thread left(build, begin, mid, depth + 1);
+				build(mid + 1, end, depth + 1);
+				left.join();
+			}
+			else {
+				build(begin, mid, depth + 1);
+				build(mid + 1, end, depth + 1);
+			}
+		};
+		build(0, order.size(), 0);
+		//positions in tree order, and the queries go in tree order too: neighbours are close in memory
+		std::vector<point> positions(order.size());
+		parallel_for(order.size(), workers, [&](size_t begin, size_t end) {
+			for (size_t k = begin; k < end; k++)
+				positions[k] = particles[order[k]].position;
+		});
+
+		std::vector<double> radii(particles.size());
+		parallel_for(particles.size(), workers, [&](size_t begin, size_t end) {
+			std::vector<double> nearest;//max-heap of the smallest squared distances
+			for (size_t self_k = begin; self_k < end; self_k++) {
+				const point position = positions[self_k];
+				nearest.clear();
+				auto consider = [&](size_t k) {
+					if (k == self_k)
+						return;
+					double distance = (positions[k] - position).norma2();
+					if (nearest.size() < neighbours) {
+						nearest.push_back(distance);
+						std::push_heap(nearest.begin(), nearest.end());
+					}
+					else if (distance < nearest.front()) {
+						std::pop_heap(nearest.begin(), nearest.end());
+						nearest.back() = distance;
+						std::push_heap(nearest.begin(), nearest.end());
+					}
+				};
+				auto search = [&](auto& self, size_t first, size_t last, size_t depth) -> void {
+					if (last - first <= leaf_size) {
+						for (size_t k = first; k < last; k++)
+							consider(k);
+						return;
+					}
+					size_t mid = (first + last) / 2, axis = depth & 1;
+					double offset = position[axis] - positions[mid][axis];
+					//the lower half is not above the median, the upper one not below it
+					size_t near_first = (offset < 0) ? first : mid + 1, near_last = (offset < 0) ? mid : last;
+					size_t far_first = (offset < 0) ? mid + 1 : first, far_last = (offset < 0) ? last : mid;
+					self(self, near_first, near_last, depth + 1);
+					if (nearest.size() < neighbours || offset * offset < nearest.front()) {
+						consider(mid);
+						self(self, far_first, far_last, depth + 1);
+					}
+				};
+				search(search, 0, order.size(), 0);
+				radii[order[self_k]] = std::sqrt(nearest.front());
+			}
+		});
+		//coincident particles keep what they had
+		for (size_t i = 0; i < particles.size(); i++)
+			if (radii[i] > 0)
+				particles[i].radius = radii[i];
+	}
+
+	//axially symmetric cloud at rest: particle i at the radius inverse_mass_fraction(u) for a uniform u
+	template<typename F>
+	inline std::vector<particle> radial_profile(const cloud& config, F inverse_mass_fraction) {
+		constexpr double two_pi = 6.283185307179586476925286766559;
+		std::vector<particle> particles(config.amount);
+		parallel_for(config.amount, config.workers, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				counter_rng rng(config.seed, i);
+				double r = inverse_mass_fraction(rng.uniform(0));
+				double angle = two_pi * rng.uniform(1);
+				particles[i] = particle({ r * std::cos(angle), r * std::sin(angle) }, { 0,0 }, { 0,0 }, config.mass, config.radius, 0, 1);
+			}
+		});
+		smoothing_from_density(particles, config.neighbours, config.workers);
+		return particles;
+	}
+
+	//uniform surface density, the viewer's start-up cloud with viewer_disc_radius
+	inline std::vector<particle> uniform_disc(const cloud& config, double disc_radius) {
+		return radial_profile(config, [=](double u) { return disc_radius * std::sqrt(u); });
+	}
+
+	//projected plummer sphere, surface density ~ (1 + r^2 / a^2)^-2, cut at cutoff_radius
+	inline std::vector<particle> plummer(const cloud& config, double scale_radius, double cutoff_radius) {
+		const double a2 = scale_radius * scale_radius;
+		const double inside = cutoff_radius * cutoff_radius / (cutoff_radius * cutoff_radius + a2);
+		return radial_profile(config, [=](double u) {
+			double fraction = u * inside;
+			return std::sqrt(a2 * fraction / (1. - fraction));
+		});
+	}
+
+	//isothermal sphere with a core, projected: surface density ~ 1 / sqrt(r^2 + r_core^2), cut at outer_radius
+	inline std::vector<particle> isothermal(const cloud& config, double core_radius, double outer_radius) {
+		const double edge = std::sqrt(outer_radius * outer_radius + core_radius * core_radius);
+		return radial_profile(config, [=](double u) {
+			double s = core_radius + u * (edge - core_radius);
+			return std::sqrt(max<double>(s * s - core_radius * core_radius, 0));
+		});
+	}
+
+	//solid body rotation around center, counterclockwise for a positive angular velocity
+	inline void add_rotation(std::vector<particle>& particles, double angular_velocity, point center = { 0,0 }, size_t workers = 0) {
+		parallel_for(particles.size(), workers, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				point r = particles[i].position - center;
+				particles[i].velocity += point{ -r[1], r[0] } * angular_velocity;
+			}
+		});
+	}
+
+	//divergence-free random velocities with the given rms and no bulk motion: the curl of a stream function
+	//which is white noise on a grid smoothed by randomise_dsfield, so correlation_cells sets the eddy size
+	inline void add_turbulence(std::vector<particle>& particles, double rms_velocity, uint64_t seed,
+		int64_t grid = 256, int64_t correlation_cells = 8, size_t workers = 0) {
+		if (particles.empty() || grid < 2)
+			return;
+		point lo = particles[0].position, hi = lo;
+		for (auto& prt : particles) {
+			for (int d = 0; d < 2; d++) {
+				lo[d] = min<double>(lo[d], prt.position[d]);
+				hi[d] = max<double>(hi[d], prt.position[d]);
+			}
+		}
+		const double side = max<double>(max<double>(hi[0] - lo[0], hi[1] - lo[1]), grav_eq_utils::epsilon);
+		const double cell_size = side / (grid - 1);
+
+		counter_rng rng(seed, 0);
+		dsfield stream((size_t)grid);
+		randomise_dsfield(stream, correlation_cells, 0.5, 1., 2,
+			[&](int64_t x, int64_t y) { return rng.uniform((uint64_t)(y * grid + x)); });
+		//velocities on the grid, in grid units: the rms is set at the end
+		dsfield vx((size_t)grid), vy((size_t)grid);
+		for (int64_t y = 0; y < grid; y++) {
+			for (int64_t x = 0; x < grid; x++) {
+				int64_t x0 = max<int64_t>(x - 1, 0), x1 = min<int64_t>(x + 1, grid - 1);
+				int64_t y0 = max<int64_t>(y - 1, 0), y1 = min<int64_t>(y + 1, grid - 1);
+				vx[y][x] = (stream[y1][x] - stream[y0][x]) / (double)(y1 - y0);
+				vy[y][x] = -(stream[y][x1] - stream[y][x0]) / (double)(x1 - x0);
+			}
+		}
+
+		std::vector<point> added(particles.size());
+		parallel_for(particles.size(), workers, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++) {
+				double gx = (particles[i].position[0] - lo[0]) / cell_size;
+				double gy = (particles[i].position[1] - lo[1]) / cell_size;
+				int64_t ix = std::clamp<int64_t>((int64_t)gx, 0, grid - 2);
+				int64_t iy = std::clamp<int64_t>((int64_t)gy, 0, grid - 2);
+				double fx = gx - ix, fy = gy - iy;
+				auto bilinear = [&](const dsfield& f) {
+					return (f[iy][ix] * (1 - fx) + f[iy][ix + 1] * fx) * (1 - fy) +
+						(f[iy + 1][ix] * (1 - fx) + f[iy + 1][ix + 1] * fx) * fy;
+				};
+				added[i] = { bilinear(vx), bilinear(vy) };
+			}
+		});
+
+		double total_mass = parallel_sum<double>(particles.size(), workers, [&](size_t i) { return particles[i].mass; });
+		if (!(total_mass > 0))
+			return;
+		point bulk = parallel_sum<point>(particles.size(), workers, [&](size_t i) { return added[i] * particles[i].mass; }) / total_mass;
+		double square_sum = parallel_sum<double>(particles.size(), workers, [&](size_t i) { return (added[i] - bulk).norma2(); });
+		double rms = std::sqrt(square_sum / particles.size());
+		if (!(rms > 0))
+			return;
+		const double scale = rms_velocity / rms;
+		parallel_for(particles.size(), workers, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; i++)
+				particles[i].velocity += (added[i] - bulk) * scale;
+		});
+	}
+}
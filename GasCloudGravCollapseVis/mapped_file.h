@@ -0,0 +1,109 @@
+#pragma once
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#ifdef _WIN32
+	#include <Windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+//a whole file mapped read-only into memory; pages are read in by the OS on first access
+class mapped_file {
+	const char* bytes = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+
+	inline void unmap() {
+#ifdef _WIN32
+		if (bytes)
+			UnmapViewOfFile(bytes);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		file = INVALID_HANDLE_VALUE;
+		mapping = nullptr;
+#else
+		if (bytes)
+			munmap((void*)bytes, length);
+#endif
+		bytes = nullptr;
+		length = 0;
+	}
+public:
+	mapped_file() = default;
+	explicit mapped_file(const std::string& path) {
+#ifdef _WIN32
+		file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		LARGE_INTEGER size;
+		if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+			unmap();
+			throw std::runtime_error("cannot open " + path);
+		}
+		length = (size_t)size.QuadPart;
+		if (!length)
+			return;
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		bytes = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+		if (!bytes) {
+			unmap();
+			throw std::runtime_error("cannot map " + path);
+		}
+#else
+		int descriptor = open(path.c_str(), O_RDONLY);
+		struct stat info;
+		if (descriptor < 0 || fstat(descriptor, &info)) {
+			if (descriptor >= 0)
+				close(descriptor);
+			throw std::runtime_error("cannot open " + path);
+		}
+		length = (size_t)info.st_size;
+		if (length) {
+			void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+			if (address == MAP_FAILED) {
+				close(descriptor);
+				length = 0;
+				throw std::runtime_error("cannot map " + path);
+			}
+			bytes = (const char*)address;
+		}
+		close(descriptor);
+#endif
+	}
+	~mapped_file() {
+		unmap();
+	}
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	mapped_file(mapped_file&& other) noexcept {
+		*this = std::move(other);
+	}
+	mapped_file& operator=(mapped_file&& other) noexcept {
+		if (this != &other) {
+			unmap();
+			std::swap(bytes, other.bytes);
+			std::swap(length, other.length);
+#ifdef _WIN32
+			std::swap(file, other.file);
+			std::swap(mapping, other.mapping);
+#endif
+		}
+		return *this;
+	}
+
+	inline const char* data() const {
+		return bytes;
+	}
+	inline size_t size() const {
+		return length;
+	}
+};
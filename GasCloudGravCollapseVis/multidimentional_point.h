@@ -2,6 +2,7 @@
 #include <cstdio>
 #include <array>
 #include <cmath>
+#include <cfloat>
 #include <ostream>
 #include <initializer_list>
 
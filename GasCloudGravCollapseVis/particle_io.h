@@ -0,0 +1,167 @@
+#pragma once
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "grav_eq_iterator.h"
+#include "mapped_file.h"
+
+//plain text particle files, one particle per line:
+//x y vx vy mass radius energy
+//separated by spaces, tabs or commas; empty lines and lines starting with # are skipped, and so is a first line
+//which starts with a letter and is not a particle (a csv header). what write_particles produces can be read back as initial conditions
+namespace particle_io {
+	//start of what a line holds, nullptr for empty lines and comments
+	inline const char* line_content(const char* cur, const char* line_end) {
+		while (cur < line_end && (*cur == ' ' || *cur == '\t' || *cur == '\r'))
+			cur++;
+		return (cur == line_end || *cur == '#') ? nullptr : cur;
+	}
+
+	inline const char* line_end_of(const char* cur, const char* end) {
+		auto newline = (const char*)memchr(cur, '\n', end - cur);
+		return newline ? newline : end;
+	}
+
+	//false if the line does not start with 7 numbers, what follows them is ignored
+	inline bool parse_particle(const char* cur, const char* line_end, particle& prt) {
+		double values[7];
+		for (auto& value : values) {
+			while (cur < line_end && (*cur == ' ' || *cur == '\t' || *cur == ','))
+				cur++;
+			if (cur < line_end && *cur == '+')
+				cur++;
+			auto result = std::from_chars(cur, line_end, value);
+			if (result.ec != std::errc())
+				return false;
+			cur = result.ptr;
+		}
+		prt = particle({ values[0], values[1] }, { values[2], values[3] }, { 0,0 }, values[4], values[5], values[6], 1);
+		return true;
+	}
+
+	//the file is mapped and cut into chunks at line ends; one pass counts the particles of every chunk,
+	//the second parses every chunk straight into its place in the result. both run on workers threads
+	inline std::vector<particle> read_particles(const std::string& path, size_t workers = 0) {
+		mapped_file file(path);
+		const char* begin = file.data();
+		const char* const end = begin + file.size();
+		size_t skipped_lines = 0;
+		for (const char* cur = begin; cur < end; ) {
+			const char* line_end = line_end_of(cur, end);
+			const char* content = line_content(cur, line_end);
+			if (content) {
+				//nan and inf start with a letter too, a header is a line which does not parse
+				particle first;
+				if ((isalpha((unsigned char)*content) || *content == '"') && !parse_particle(content, line_end, first)) {
+					begin = min(line_end + 1, end);
+					skipped_lines++;
+				}
+				break;
+			}
+			cur = line_end + 1;
+			skipped_lines++;
+			begin = min(cur, end);
+		}
+
+		if (!workers)
+			workers = max<size_t>(std::thread::hardware_concurrency(), 1);
+		struct chunk {
+			const char* begin = nullptr;
+			const char* end = nullptr;
+			size_t lines = 0;
+			size_t particles = 0;
+			std::string error;
+		};
+		constexpr size_t min_chunk_bytes = 1 << 20;
+		const size_t bytes = end - begin;
+		const size_t chunk_count = max<size_t>(min<size_t>(workers * 8, bytes / min_chunk_bytes), 1);
+		std::vector<chunk> chunks;
+		for (const char* cur = begin; cur < end; ) {
+			const char* chunk_end = (chunks.size() + 1 == chunk_count) ? end :
+				line_end_of(min(cur + bytes / chunk_count, end), end);
+			chunk_end = min(chunk_end + 1, end);
+			chunk next;
+			next.begin = cur;
+			next.end = chunk_end;
+			chunks.push_back(std::move(next));
+			cur = chunk_end;
+		}
+
+		auto for_each_chunk = [&](auto function) {
+			std::atomic<size_t> next_chunk(0);
+			auto work = [&]() {
+				for (size_t c; (c = next_chunk++) < chunks.size();)
+					function(chunks[c]);
+			};
+			std::vector<std::thread> threads;
+			for (size_t w = 1; w < min(workers, chunks.size()); w++)
+				threads.emplace_back(work);
+			work();
+			for (auto& thread : threads)
+				thread.join();
+		};
+		for_each_chunk([&](chunk& part) {
+			for (const char* cur = part.begin; cur < part.end; ) {
+				const char* line_end = line_end_of(cur, part.end);
+				part.lines++;
+				if (line_content(cur, line_end))
+					part.particles++;
+				cur = line_end + 1;
+			}
+		});
+
+		std::vector<size_t> first_particle(chunks.size() + 1, 0), first_line(chunks.size(), skipped_lines);
+		for (size_t c = 0; c < chunks.size(); c++) {
+			first_particle[c + 1] = first_particle[c] + chunks[c].particles;
+			if (c)
+				first_line[c] = first_line[c - 1] + chunks[c - 1].lines;
+		}
+		std::vector<particle> particles(first_particle.back());
+		for_each_chunk([&](chunk& part) {
+			size_t c = &part - chunks.data();
+			particle* out = particles.data() + first_particle[c];
+			size_t line_number = first_line[c];
+			for (const char* cur = part.begin; cur < part.end; ) {
+				const char* line_end = line_end_of(cur, part.end);
+				line_number++;
+				if (const char* content = line_content(cur, line_end)) {
+					if (!parse_particle(content, line_end, *out++)) {
+						part.error = path + ":" + std::to_string(line_number) + ": expected 7 numbers";
+						return;
+					}
+				}
+				cur = line_end + 1;
+			}
+		});
+		for (auto& part : chunks)
+			if (part.error.size())
+				throw std::runtime_error(part.error);
+		return particles;
+	}
+
+	inline void write_particles(const std::string& path, const quad_tree& tree, size_t step, double time) {
+		std::ofstream file(path);
+		if (!file)
+			throw std::runtime_error("cannot open " + path);
+		char line[256];
+		snprintf(line, sizeof(line), "# step %zu time %.17g\n", step, time);
+		file << line << "# x y vx vy mass radius energy\n";
+		tree.for_each_particle([&](const particle& prt) {
+			snprintf(line, sizeof(line), "%.17g %.17g %.17g %.17g %.17g %.17g %.17g\n",
+				prt.position[0], prt.position[1], prt.velocity[0], prt.velocity[1], prt.mass, prt.radius, prt.energy);
+			file << line;
+		});
+		if (!file)
+			throw std::runtime_error("cannot write " + path);
+	}
+}
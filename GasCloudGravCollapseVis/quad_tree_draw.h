@@ -0,0 +1,134 @@
+#pragma once
+#include <cmath>
+#include <stack>
+
+#include "grav_eq_iterator.h"
+
+//OpenGL side of the tree, the engine itself knows nothing about drawing.
+//needs get_color (field_vis.h) and the view globals of the window (RANGE, WindX, WindY, centx, centy)
+
+namespace draw_type {
+	enum class dt {
+		density, energy, x_speed, y_speed, x_acceleration, y_acceleration
+	};
+}
+
+inline void draw_smooth_circle(const float x, const float y, const float r, const float value, const float dvalue, const float dangle) {
+	float begin = grav_eq_utils::pressure_core(0, r);
+	for (float val = begin; val > 0.005; val /= dvalue) {
+
+		float rad = grav_eq_utils::inverse_pressure_core(val, r);
+
+		auto [pr, pg, pb] = get_color(val*value);
+
+		glColor4f(pr, pg, pb, 0.025f);
+
+		glBegin(GL_POLYGON);
+	
+		for (float i = 0.f; i < 360.f; i += dangle)
+			glVertex2f(rad * cos(ANGTORAD(i)) + x, rad * sin(ANGTORAD(i)) + y);
+
+		glEnd();
+
+	}
+}
+
+inline void draw_tree(const quad_tree& tree, int draw_level, const point& center, double side_size, float points_size, float value_decrimemnt, draw_type::dt type = draw_type::dt::density, bool extra_flare = false, bool edge_drawer = false, bool draw_points = false, bool extended_draw = false) {
+	std::stack <pair<node*,int>> cur_nodes;
+	point	lb_sc{ (0 - RANGE) * (WindX / WINDXSIZE) - centx, (0 - RANGE) * (WindY / WINDYSIZE) - centy}, 
+			rt_sc{ { ( RANGE) * (WindX / WINDXSIZE) - centx, (RANGE) * (WindY / WINDYSIZE) - centy} };
+	pair<node*, int> cur_node = { tree.root_node , 0 };
+	node* temp = nullptr;
+	double size = (_x(tree.root_node->righttop_corner) - _x(tree.root_node->leftbottom_corner));
+	side_size /= size;
+	while (true) {
+		if (cur_node.first) {
+			if (cur_node.second<draw_level && cur_node.first->particles_count_in_subtrees 
+				// && cur_node.first->righttop_corner >= lb_sc && cur_node.first->leftbottom_corner <= rt_sc // positioning on screen
+				) {
+				for (node::positioning i = node::positioning::leftbottom; i < node::positioning::null; ((int&)i)++) {
+					if ((temp = cur_node.first->get(i))) {
+						cur_nodes.push({ temp, cur_node.second + 1 });
+					}
+				}
+			}
+			else {
+				point lb = (cur_node.first->leftbottom_corner * side_size + center);
+				point rt = (cur_node.first->righttop_corner * side_size + center);
+				double particle_value = 0;
+				double node_value = 0;
+				double ratio = (cur_node.first->mass_center.radius * cur_node.first->mass_center.radius) / std::pow(_x(cur_node.first->leftbottom_corner - cur_node.first->righttop_corner), 2);
+				bool visited = cur_node.first->mass_center.visited;
+				auto position = (cur_node.first->mass_center.position * side_size + center);
+				switch (type) {
+				case draw_type::dt::density: // std::pow(_x(cur_node.first->leftbottom_corner - cur_node.first->righttop_corner), 2)
+					particle_value = cur_node.first->mass_center.mass / (cur_node.first->mass_center.radius);
+					node_value = particle_value * ratio;
+					break;
+				case draw_type::dt::energy:
+					particle_value = cur_node.first->mass_center.energy;
+					node_value = particle_value * ratio;
+					break;
+				case draw_type::dt::x_speed:
+					particle_value = cur_node.first->mass_center.velocity[0];
+					node_value = particle_value * ratio;
+					break;
+				case draw_type::dt::y_speed:
+					particle_value = cur_node.first->mass_center.velocity[1];
+					node_value = particle_value * ratio;
+					break;
+				case draw_type::dt::x_acceleration:
+					particle_value = cur_node.first->mass_center.acceleration[0];
+					node_value = particle_value * ratio;
+					break;
+				case draw_type::dt::y_acceleration:
+					particle_value = cur_node.first->mass_center.acceleration[1];
+					node_value = particle_value * ratio;
+					break;
+				} 
+				auto [nr, ng, nb] = get_color(node_value * value_decrimemnt);
+
+				if(edge_drawer){
+					glBegin(GL_LINE_LOOP);
+					glColor4f(nr, ng, nb, 1);
+					glVertex2f(_x(lb), _y(lb));
+					glVertex2f(_x(lb), _y(rt));
+					glVertex2f(_x(rt), _y(rt));
+					glVertex2f(_x(rt), _y(lb));
+					glEnd();
+				}
+				if(extended_draw){
+					draw_smooth_circle(_x(position), _y(position), 
+						cur_node.first->mass_center.radius*side_size, 
+						particle_value * value_decrimemnt,
+						1.10, 60
+					);
+				}
+				else {
+					auto [pr, pg, pb] = get_color(particle_value * value_decrimemnt);
+					auto a = (pr + pg + pb) * 0.15;
+
+					glPointSize(side_size * 2 * cur_node.first->mass_center.radius);
+					glColor4f(pr, pg, pb, 0.05 + 0.05 * visited + a);
+					glBegin(GL_POINTS);
+					glVertex2f(_x(position), _y(position));
+					glEnd();
+				}
+				
+				if (draw_points) {
+					glPointSize(points_size + extra_flare * points_size);
+					glColor4f(0.5 + extra_flare * visited, 0.5 - extra_flare * visited, 0.5 + 0.5 * visited, 0.5);
+					glBegin(GL_POINTS);
+					glVertex2f(_x(position), _y(position));
+					glEnd();
+				}
+			}
+		}
+		if (cur_nodes.size()) {
+			cur_node = cur_nodes.top();
+			cur_nodes.pop();
+		}
+		else
+			break;
+	}
+}
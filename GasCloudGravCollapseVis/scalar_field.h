@@ -0,0 +1,282 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <random>
+#include <complex>
+#include "multidimentional_point.h"
+
+//square fields of values and the edge policies for them; no drawing here, see field_vis.h
+
+namespace fv_utils {
+	inline std::default_random_engine gen;
+	inline std::mt19937 mtrand(gen());
+	inline std::uniform_real_distribution<double> distr(0., 1.);
+	inline double rdrand() {
+		return distr(mtrand);
+	}
+}
+
+using iline = std::vector<int>;
+using line = std::vector<double>;
+using pline = std::vector<Point<2>>;
+using cline = std::vector<std::complex<double>>;
+
+using ifield = std::vector<iline>;
+using field = std::vector<line>;
+using pfield = std::vector<pline>;
+using cfield = std::vector<cline>;
+
+using fv_utils::rdrand;
+
+inline auto constant_edge = [](field &f, int64_t x, int64_t y, double &val) -> double& {
+	if (x >= 0 && x < f.size() && y >= 0 && y < f.size())
+		return f[y][x];
+	else 
+		return val;
+};
+inline auto c_constant_edge = [](const field &f, int64_t x, int64_t y, const double &val) -> double {
+	if (x >= 0 && x < f.size() && y >= 0 && y < f.size())
+		return f[y][x];
+	else 
+		return val;
+};
+
+inline auto reflect_edge = [](field &f, int64_t x, int64_t y, double &val) -> double& {
+	if (x >= 0 && x < f.size() && y >= 0 && y < f.size())
+		return f[y][x];
+	else {
+		if (x < 0) x = 0;
+		else x = f.size() - 1;
+		if (y < 0) y = 0;
+		else y = f.size() - 1;
+		val = -f[y][x];
+		return val;
+	}
+};
+inline auto c_reflect_edge = [](const field &f, int64_t x, int64_t y, const double &val) -> double {
+	if (x >= 0 && x < f.size() && y >= 0 && y < f.size())
+		return f[y][x];
+	else {
+		if (x < 0)x = 0;
+		else x = f.size() - 1;
+		if (y < 0)y = 0;
+		else y = f.size() - 1;
+		return -f[y][x];
+	}
+};
+
+inline auto continue_edge = [](field &f, int64_t x, int64_t y, double &val) -> double& {
+	if (x >= 0 && x < f.size() && y >= 0 && y < f.size())
+		return f[y][x];
+	else {
+		if (x < 0) x = 0;
+		else x = f.size() - 1;
+		if (y < 0) y = 0;
+		else y = f.size() - 1;
+		val = f[y][x];
+		return val;
+	}
+};
+inline auto c_continue_edge = [](const field &f, int64_t x, int64_t y, const double &val) -> double {
+	if (x >= 0 && x < f.size() && y >= 0 && y < f.size())
+		return f[y][x];
+	else {
+		if (x < 0)x = 0;
+		else x = f.size() - 1;
+		if (y < 0)y = 0;
+		else y = f.size() - 1;
+		return f[y][x];
+	}
+};
+
+inline auto pass_edge = [](field &f, int64_t x, int64_t y, double &val) -> double& {
+	if (x >= 0 && x < f.size() && y >= 0 && y < f.size())
+		return f[y][x];
+	else {
+
+	}
+};
+inline auto c_pass_edge = [](const field &f, int64_t x, int64_t y, const double &val) -> double {
+	if (x >= 0 && x < f.size() && y >= 0 && y < f.size())
+		return f[y][x];
+	else {
+
+	}
+};
+
+typedef struct complex_square_field {
+	cfield fd;
+	std::complex<double> garbage_var, outside_val;
+	bool ivdev;
+	int64_t field_size; 
+	complex_square_field(size_t n = 100, std::complex<double> outside_val = 0., bool is_value_defined_edge_value = true) : field_size(n), outside_val(outside_val) {
+		cline cld(n, 0);
+		fd.assign(n, cld);
+		ivdev = is_value_defined_edge_value;
+	}
+	const std::complex<double>& at(int64_t x, int64_t y) const {
+		if (x >= 0 && x < field_size && y >= 0 && y < field_size)
+			return fd[y][x];
+		else {
+			if (ivdev)
+				return outside_val;
+			else {
+				if (x < 0)x = 0;
+				else x = field_size - 1;
+				if (y < 0)y = 0;
+				else y = field_size - 1;
+				return fd[y][x];
+			}
+		}
+	}
+	std::complex<double>& at(int64_t x, int64_t y) {
+		if (x >= 0 && x < field_size && y >= 0 && y < field_size)
+			return fd[y][x];
+		else {
+			if (ivdev) {
+				garbage_var = outside_val;
+				return garbage_var;
+			}
+			else {
+				if (x < 0)x = 0;
+				else x = field_size - 1;
+				if (y < 0)y = 0;
+				else y = field_size - 1;
+				garbage_var = fd[y][x];
+				return garbage_var;
+			}
+		}
+	}
+	cline& operator[](int64_t N) {
+		return fd[N];
+	}
+	const cline& operator[](int64_t N) const {
+		return fd[N];
+	}
+	void swap(complex_square_field& dsf) {
+		fd.swap(dsf.fd);
+	}
+	size_t size() const {
+		return fd.size();
+	}
+} csfield;
+
+typedef struct drawable_square_field {
+	field fd;
+	double garbage_var, outside_val;
+	double&(*edge_handler)(field&, int64_t, int64_t, double&);
+	double(*const_edge_handler)(const field&, int64_t, int64_t, const double&);
+	int64_t field_size;
+	double cell_size;
+	drawable_square_field(size_t n = 100, double outside_val = 0.,
+		double&(*edge_handler)(field&, int64_t, int64_t, double&) = constant_edge,
+		double(*const_edge_handler)(const field&, int64_t, int64_t, const double&) = c_constant_edge
+	) : field_size(n), outside_val(outside_val), edge_handler(edge_handler), const_edge_handler(const_edge_handler){
+		line ld(n, 0);
+		fd.assign(n, ld);
+		garbage_var = 0;
+	}
+	//by value: an edge policy may make up a value which is not in the field
+	double at(int64_t x, int64_t y) const {
+		return const_edge_handler(fd, x, y, outside_val);
+	}
+	double& at(int64_t x, int64_t y) {
+		garbage_var = outside_val;
+		return edge_handler(fd, x, y, garbage_var);
+	}
+	line& operator[](int64_t N) {
+		return fd[N];
+	}
+	const line& operator[](int64_t N) const {
+		return fd[N];
+	}
+	void swap(drawable_square_field& dsf) {
+		fd.swap(dsf.fd);
+	}
+	size_t size() const {
+		return fd.size();
+	}
+} dsfield;
+
+//function(first, last) over bands of rows [first, last), one band per thread
+template<typename F>
+void for_each_row_band(int64_t rows, size_t workers, F function) {
+	if (!workers)
+		workers = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	workers = (size_t)std::max<int64_t>(std::min<int64_t>((int64_t)workers, rows), 1);
+	std::vector<std::thread> threads;
+	for (size_t w = 1; w < workers; w++)
+		threads.emplace_back(function, rows * (int64_t)w / (int64_t)workers, rows * (int64_t)(w + 1) / (int64_t)workers);
+	function(0, rows / (int64_t)workers);
+	for (auto& thread : threads)
+		thread.join();
+}
+
+//passes of a (2 * rad + 1)^2 box average, cells outside of the field are left out of it (not the edge handler).
+//the box is separable: a running sum along every row (in place, a row at a time), then a running sum down
+//every column into a second buffer, each pass is O(n^2) whatever rad is. both halves go by bands of rows
+inline void smooth_dsfield(dsfield& dsf, int64_t rad, double mul = 1., int64_t passes = 1, size_t workers = 0) {
+	const int64_t n = (int64_t)dsf.size();
+	if (!n || passes <= 0)
+		return;
+	//how many of [i - rad, i + rad] are inside of [0, n)
+	auto window = [&](int64_t i) {
+		return (double)(std::min<int64_t>(i + rad, n - 1) - std::max<int64_t>(i - rad, 0) + 1);
+	};
+	field columns_out((size_t)n, line((size_t)n));
+	while (passes-- > 0) {
+		for_each_row_band(n, workers, [&](int64_t first, int64_t last) {
+			line row((size_t)n);
+			for (int64_t y = first; y < last; y++) {
+				line& cells = dsf[y];
+				double sum = 0;
+				for (int64_t x = 0; x < std::min<int64_t>(rad, n); x++)
+					sum += cells[x];
+				for (int64_t x = 0; x < n; x++) {
+					if (x + rad < n)
+						sum += cells[x + rad];
+					if (x - rad - 1 >= 0)
+						sum -= cells[x - rad - 1];
+					row[x] = sum / window(x);
+				}
+				cells.swap(row);
+			}
+		});
+		for_each_row_band(n, workers, [&](int64_t first, int64_t last) {
+			line sums((size_t)n, 0.);
+			for (int64_t y = std::max<int64_t>(first - rad - 1, 0); y < std::min<int64_t>(first + rad, n); y++)
+				for (int64_t x = 0; x < n; x++)
+					sums[x] += dsf[y][x];
+			for (int64_t y = first; y < last; y++) {
+				if (y + rad < n)
+					for (int64_t x = 0; x < n; x++)
+						sums[x] += dsf[y + rad][x];
+				if (y - rad - 1 >= 0)
+					for (int64_t x = 0; x < n; x++)
+						sums[x] -= dsf[y - rad - 1][x];
+				const double scale = mul / window(y);
+				for (int64_t x = 0; x < n; x++)
+					columns_out[y][x] = sums[x] * scale;
+			}
+		});
+		dsf.fd.swap(columns_out);
+	}
+}
+
+//noise(x, y) gives the value of a cell in [0, 1) before the offset and the smoothing
+template<typename noise_source>
+void randomise_dsfield(dsfield& dsf, int64_t rastr_rad, double offset, double mul, int64_t smoothing_factor, noise_source noise) {
+	for (int64_t y = 0; y < (int64_t)dsf.size(); y++) {
+		for (int64_t x = 0; x < (int64_t)dsf.size(); x++) {
+			dsf[y][x] = (noise(x, y) - offset);
+		}
+	}
+	smooth_dsfield(dsf, rastr_rad, mul, smoothing_factor);
+}
+
+inline void randomise_dsfield(dsfield& dsf, int64_t rastr_rad, double offset = 0.5, double mul = 1., int64_t smoothing_factor=1) {
+	randomise_dsfield(dsf, rastr_rad, offset, mul, smoothing_factor, [](int64_t, int64_t) { return rdrand(); });
+}
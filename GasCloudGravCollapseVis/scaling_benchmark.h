@@ -0,0 +1,68 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <set>
+#include <vector>
+
+#include "grav_eq_iterator.h"
+#include "initial_conditions.h"
+
+//strong scaling of the step engine: the same cloud stepped with 1, 2, 4, ... workers.
+//with pinning the workers fill one numa node before the next, so the row where the node count
+//grows is where crossing a socket shows up.
+namespace scaling_benchmark {
+	inline size_t numa_nodes_used(size_t workers) {
+		auto cpus = thread_affinity::cpus_by_numa_node();
+		std::set<int> nodes;
+		for (size_t i = 0; i < workers; i++)
+			nodes.insert(thread_affinity::numa_node_of(cpus[i % cpus.size()]));
+		return nodes.size();
+	}
+
+	//seconds per step with the given worker count, after a few warm-up steps;
+	//failed_pins gets the workers the system did not let pin
+	inline double seconds_per_step(const std::vector<particle>& particles, double size, size_t workers, bool pinned, size_t steps, size_t* failed_pins = nullptr) {
+		constexpr size_t warm_up_steps = 3;
+		grav_eq_processor processor(particles, size, workers, pinned);
+		processor.start_threads(true);
+		processor.step(warm_up_steps);
+		auto begin = std::chrono::steady_clock::now();
+		processor.step(steps);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		processor.stop_threads();
+		if (failed_pins)
+			*failed_pins = processor.failed_pins;
+		return seconds / steps;
+	}
+
+	inline void run(size_t particles = 1280, size_t steps = 20, size_t max_workers = 0, bool pinned = true, unsigned seed = 1) {
+		constexpr double size = 100;
+		if (!max_workers)
+			max_workers = thread_affinity::cpu_count();
+		initial_conditions::cloud config;
+		config.amount = particles;
+		config.seed = seed;
+		auto cloud = initial_conditions::uniform_disc(config, initial_conditions::viewer_disc_radius(size));
+
+		std::vector<size_t> worker_counts;
+		for (size_t workers = 1; workers < max_workers; workers *= 2)
+			worker_counts.push_back(workers);
+		worker_counts.push_back(max_workers);
+
+		printf("step engine scaling: %zu particles, %zu steps, %s\n", particles, steps, pinned ? "pinned" : "unpinned");
+		printf("  workers  numa nodes  unpinned  s/step      speedup  efficiency\n");
+		double single = 0;
+		size_t total_failed_pins = 0;
+		for (auto workers : worker_counts) {
+			size_t failed_pins = 0;
+			double seconds = seconds_per_step(cloud, size, workers, pinned, steps, &failed_pins);
+			total_failed_pins += failed_pins;
+			if (workers == 1)
+				single = seconds;
+			printf("  %7zu  %10zu  %8zu  %10.4g  %7.2f  %9.0f%%\n", workers, pinned ? numa_nodes_used(workers) : 0, failed_pins,
+				seconds, single / seconds, 100. * single / seconds / workers);
+		}
+		if (total_failed_pins)
+			printf("  some workers could not be pinned, their numa placement is up to the scheduler\n");
+	}
+}
@@ -0,0 +1,283 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include "grav_eq_iterator.h"
+#include "scalar_field.h"
+
+//SPH interpolation of the particles onto square grids (dsfield), the same kernel as the step.
+//density is sum m_j W_j, the other fields are shepard-normalised: sum V_j A_j W_j / sum V_j W_j with V_j = m_j / rho_j.
+//every kernel is normalised over the cell centres it covers, so the grid holds the mass of the particles
+//inside of it however coarse it is (but for kernels cut by its edges); kernels narrower than a cell are widened to one cell.
+//
+//parallel without atomics: the grid is cut into tiles of tile_size cells, a particle belongs to the tile of its centre.
+//a thread deposits a tile into a private buffer of the tile plus a halo of half a tile, then adds the buffer to the grid.
+//tiles go in four colours (x and y parity), tiles of one colour are far enough apart for their halos not to meet,
+//so the colours run one after another and the tiles of a colour in parallel.
+//kernels wider than the halo go last, by bands of rows, every band takes the part of them which falls into it
+namespace sph_deposit {
+	constexpr int64_t tile_size = 64;
+	constexpr int64_t halo = tile_size / 2;
+
+	//the square of the grid, the default is the square the processor simulates
+	struct region {
+		point center = { 0,0 };
+		double side = 100;
+	};
+
+	//fields to fill, nullptr to skip one; all of the same size, which is the resolution
+	struct targets {
+		dsfield* density = nullptr;
+		dsfield* energy = nullptr;
+		dsfield* vx = nullptr;
+		dsfield* vy = nullptr;
+	};
+
+	namespace detail {
+		using kernel = grav_eq_utils::kernel_type;
+
+		//a particle in cell units, with its kernel normalised over the cell centres
+		struct source {
+			double x, y;//cell (i, j) has its centre at (i, j)
+			double h;
+			double inv_h;
+			double mass;//m / sum W, sum over the cells of the kernel
+			double volume;//V / sum W
+			double energy, vx, vy;
+			int64_t x0, x1, y0, y1;//cells of the kernel, inclusive, not clipped to the grid
+
+			inline bool is_wide() const {
+				return h > halo;
+			}
+		};
+
+		//function(x, y, w) for the kernel cells in [x_lo, x_hi] x [y_lo, y_hi], w = shape(q)
+		template<typename F>
+		inline void for_each_cell(const source& src, int64_t x_lo, int64_t x_hi, int64_t y_lo, int64_t y_hi, F function) {
+			for (int64_t y = max<int64_t>(src.y0, y_lo); y <= min<int64_t>(src.y1, y_hi); y++) {
+				const double dy = (y - src.y) * src.inv_h;
+				const double dy2 = dy * dy;
+				if (dy2 >= 1.)
+					continue;
+				for (int64_t x = max<int64_t>(src.x0, x_lo); x <= min<int64_t>(src.x1, x_hi); x++) {
+					const double dx = (x - src.x) * src.inv_h;
+					const double q2 = dx * dx + dy2;
+					if (q2 < 1.)
+						function(x, y, kernel::shape(std::sqrt(q2)));
+				}
+			}
+		}
+
+		struct accumulators {
+			double* density;
+			double* weight;
+			double* energy;
+			double* vx;
+			double* vy;
+		};
+
+		inline void add(const source& src, const accumulators& to, size_t index, double w) {
+			if (to.density)
+				to.density[index] += src.mass * w;
+			if (to.weight) {
+				const double vw = src.volume * w;
+				to.weight[index] += vw;
+				if (to.energy)
+					to.energy[index] += vw * src.energy;
+				if (to.vx)
+					to.vx[index] += vw * src.vx;
+				if (to.vy)
+					to.vy[index] += vw * src.vy;
+			}
+		}
+
+		template<typename F>
+		inline void run_on_threads(size_t workers, F function) {
+			std::vector<std::thread> threads;
+			for (size_t t = 1; t < workers; t++)
+				threads.emplace_back(function);
+			function();
+			for (auto& thread : threads)
+				thread.join();
+		}
+	}
+
+	inline void deposit(const particle_columns& particles, const region& area, const targets& out, size_t workers = 0) {
+		using namespace detail;
+		dsfield* const fields[] = { out.density, out.energy, out.vx, out.vy };
+		dsfield* first = nullptr;
+		for (auto f : fields)
+			if (f && !first)
+				first = f;
+		if (!first || !first->size())
+			return;
+		const int64_t n = (int64_t)first->size();
+		const double cell = area.side / n;
+		const point lo = { area.center[0] - area.side / 2, area.center[1] - area.side / 2 };
+		const bool is_interpolating = out.energy || out.vx || out.vy;
+		if (!workers)
+			workers = max<size_t>(std::thread::hardware_concurrency(), 1);
+		for (auto f : fields) {
+			if (!f)
+				continue;
+			f->cell_size = cell;
+			for_each_row_band(n, workers, [&](int64_t first_row, int64_t last_row) {
+				for (int64_t y = first_row; y < last_row; y++)
+					std::fill((*f)[y].begin(), (*f)[y].end(), 0.);
+			});
+		}
+		field weights;
+		if (is_interpolating)
+			weights.assign((size_t)n, line((size_t)n, 0.));
+
+		//sources, with their kernels normalised in parallel; the ones which miss the grid are dropped
+		std::vector<source> sources(particles.size());
+		std::vector<char> is_used(particles.size(), 0);
+		for_each_row_band((int64_t)particles.size(), workers, [&](int64_t begin, int64_t end) {
+			for (int64_t i = begin; i < end; i++) {
+				source& src = sources[i];
+				src.x = (particles.x[i] - lo[0]) / cell - 0.5;
+				src.y = (particles.y[i] - lo[1]) / cell - 0.5;
+				src.h = max<double>(particles.radius[i] / cell, 1.);
+				src.inv_h = 1. / src.h;
+				src.x0 = (int64_t)std::ceil(src.x - src.h);
+				src.x1 = (int64_t)std::floor(src.x + src.h);
+				src.y0 = (int64_t)std::ceil(src.y - src.h);
+				src.y1 = (int64_t)std::floor(src.y + src.h);
+				if (src.x1 < 0 || src.y1 < 0 || src.x0 >= n || src.y0 >= n)
+					continue;
+				double sum = 0;
+				for_each_cell(src, src.x0, src.x1, src.y0, src.y1, [&](int64_t, int64_t, double w) { sum += w; });
+				if (!(sum > 0))
+					continue;
+				const double area_of_cell = cell * cell;
+				const double mass = particles.mass[i];
+				const double rho = (particles.density[i] > 0) ? particles.density[i] : mass / (pi * src.h * src.h * area_of_cell);
+				src.mass = mass / (sum * area_of_cell);
+				src.volume = mass / rho / sum;
+				src.energy = particles.energy[i];
+				src.vx = particles.vx[i];
+				src.vy = particles.vy[i];
+				is_used[i] = 1;
+			}
+		});
+
+		//narrow sources by tile, wide ones aside
+		const int64_t tiles = (n + tile_size - 1) / tile_size;
+		std::vector<std::vector<uint32_t>> tile_sources((size_t)(tiles * tiles));
+		std::vector<uint32_t> wide;
+		for (size_t i = 0; i < sources.size(); i++) {
+			if (!is_used[i])
+				continue;
+			if (sources[i].is_wide()) {
+				wide.push_back((uint32_t)i);
+				continue;
+			}
+			int64_t tx = std::clamp<int64_t>((int64_t)std::floor((sources[i].x + 0.5) / tile_size), 0, tiles - 1);
+			int64_t ty = std::clamp<int64_t>((int64_t)std::floor((sources[i].y + 0.5) / tile_size), 0, tiles - 1);
+			tile_sources[ty * tiles + tx].push_back((uint32_t)i);
+		}
+
+		auto grid_row = [&](dsfield* f, int64_t y) { return f ? (*f)[y].data() : nullptr; };
+		for (int colour = 0; colour < 4; colour++) {
+			std::vector<int64_t> coloured;
+			for (int64_t ty = colour / 2; ty < tiles; ty += 2)
+				for (int64_t tx = colour % 2; tx < tiles; tx += 2)
+					if (tile_sources[ty * tiles + tx].size())
+						coloured.push_back(ty * tiles + tx);
+			std::atomic<size_t> next_tile(0);
+			run_on_threads(min<size_t>(workers, coloured.size()), [&]() {
+				constexpr int64_t span = tile_size + 2 * halo;
+				std::vector<double> buffers[5];
+				accumulators local = {};
+				double** slots[] = { &local.density, &local.weight, &local.energy, &local.vx, &local.vy };
+				const bool is_needed[] = { out.density != nullptr, is_interpolating, out.energy != nullptr, out.vx != nullptr, out.vy != nullptr };
+				for (int k = 0; k < 5; k++) {
+					if (!is_needed[k])
+						continue;
+					buffers[k].resize(span * span);
+					*slots[k] = buffers[k].data();
+				}
+				for (size_t t; (t = next_tile++) < coloured.size();) {
+					const int64_t tx = coloured[t] % tiles, ty = coloured[t] / tiles;
+					const int64_t x_lo = max<int64_t>(tx * tile_size - halo, 0), x_hi = min<int64_t>((tx + 1) * tile_size + halo, n) - 1;
+					const int64_t y_lo = max<int64_t>(ty * tile_size - halo, 0), y_hi = min<int64_t>((ty + 1) * tile_size + halo, n) - 1;
+					const int64_t width = x_hi - x_lo + 1;
+					for (int k = 0; k < 5; k++)
+						if (is_needed[k])
+							std::fill(buffers[k].begin(), buffers[k].begin() + width * (y_hi - y_lo + 1), 0.);
+					for (auto i : tile_sources[coloured[t]]) {
+						const source& src = sources[i];
+						for_each_cell(src, x_lo, x_hi, y_lo, y_hi, [&](int64_t x, int64_t y, double w) {
+							add(src, local, (size_t)((y - y_lo) * width + (x - x_lo)), w);
+						});
+					}
+					//halo reduction: the buffer goes onto the grid, nobody else of this colour writes there
+					for (int64_t y = y_lo; y <= y_hi; y++) {
+						double* const rows[] = { grid_row(out.density, y), is_interpolating ? weights[y].data() : nullptr,
+							grid_row(out.energy, y), grid_row(out.vx, y), grid_row(out.vy, y) };
+						for (int k = 0; k < 5; k++) {
+							if (!rows[k])
+								continue;
+							const double* from = buffers[k].data() + (y - y_lo) * width;
+							for (int64_t x = 0; x < width; x++)
+								rows[k][x_lo + x] += from[x];
+						}
+					}
+				}
+			});
+		}
+
+		if (wide.size()) {
+			const int64_t bands = min<int64_t>(n, (int64_t)workers * 4);
+			std::atomic<int64_t> next_band(0);
+			run_on_threads(min<size_t>(workers, (size_t)bands), [&]() {
+				accumulators row = {};
+				int64_t row_y = -1;
+				for (int64_t band; (band = next_band++) < bands;) {
+					const int64_t y_lo = n * band / bands, y_hi = n * (band + 1) / bands - 1;
+					for (auto i : wide) {
+						const source& src = sources[i];
+						if (src.y1 < y_lo || src.y0 > y_hi)
+							continue;
+						for_each_cell(src, 0, n - 1, y_lo, y_hi, [&](int64_t x, int64_t y, double w) {
+							if (y != row_y) {
+								row = { grid_row(out.density, y), is_interpolating ? weights[y].data() : nullptr,
+									grid_row(out.energy, y), grid_row(out.vx, y), grid_row(out.vy, y) };
+								row_y = y;
+							}
+							add(src, row, (size_t)x, w);
+						});
+					}
+				}
+			});
+		}
+
+		if (is_interpolating) {
+			for_each_row_band(n, workers, [&](int64_t first_row, int64_t last_row) {
+				for (int64_t y = first_row; y < last_row; y++) {
+					for (int64_t x = 0; x < n; x++) {
+						const double weight = weights[y][x];
+						for (auto f : { out.energy, out.vx, out.vy })
+							if (f)
+								(*f)[y][x] = (weight > 0) ? (*f)[y][x] / weight : 0.;
+					}
+				}
+			});
+		}
+	}
+
+	//from the columns of the snapshot when the processor publishes them, from its tree otherwise
+	inline void deposit(const state_snapshot& snapshot, const region& area, const targets& out, size_t workers = 0) {
+		if (snapshot.columns) {
+			deposit(*snapshot.columns, area, out, workers);
+			return;
+		}
+		particle_columns gathered;
+		gathered.gather(*snapshot.tree);
+		deposit(gathered, area, out, workers);
+	}
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <cmath>
+#include <numeric>
+#include "sph_kernels.h"
+
+//equations of state as compile-time policies.
+//every policy has static pressure(density, energy, heat_capacity) and says whether it depends_on_energy; exponents are template parameters,
+//so powers are unrolled into multiplies, sqrt and cbrt instead of a generic std::pow.
+namespace sph_eos {
+	//x^(1/den) by chains of sqrt/cbrt where possible
+	template<int den>
+	inline double root(double x) {
+		static_assert(den > 0, "root of non-positive degree");
+		if constexpr (den == 1)
+			return x;
+		else if constexpr (den == 2)
+			return std::sqrt(x);
+		else if constexpr (den == 3)
+			return std::cbrt(x);
+		else if constexpr (den % 2 == 0)
+			return root<den / 2>(std::sqrt(x));
+		else if constexpr (den % 3 == 0)
+			return root<den / 3>(std::cbrt(x));
+		else
+			return std::pow(x, 1. / den);
+	}
+
+	//x^(num/den) for x >= 0
+	template<int num, int den>
+	inline double rational_power(double x) {
+		static_assert(num >= 0 && den > 0, "only non-negative rational exponents");
+		constexpr int divisor = std::gcd(num, den);
+		constexpr int n = num / divisor, d = den / divisor;
+		constexpr int whole = n / d, rest = n % d;
+		if constexpr (rest == 0)
+			return sph_kernels::ipow<whole>(x);
+		else
+			return sph_kernels::ipow<whole>(x) * sph_kernels::ipow<rest>(root<d>(x));
+	}
+
+	//P = (gamma - 1) * rho * e
+	struct ideal_gas {
+		static constexpr bool depends_on_energy = true;
+		static inline double pressure(double density, double energy, double heat_capacity) {
+			return (heat_capacity - 1) * density * energy;
+		}
+	};
+
+	//P = |rho|^(num/den)
+	template<int num, int den>
+	struct polytrope {
+		static constexpr double exponent = (double)num / den;
+		static constexpr bool depends_on_energy = false;
+		static inline double pressure(double density, double energy, double heat_capacity) {
+			return rational_power<num, den>(std::abs(density));
+		}
+	};
+
+	//P = (cs2_num/cs2_den) * rho
+	template<int cs2_num, int cs2_den = 1>
+	struct isothermal {
+		static constexpr double sound_speed_squared = (double)cs2_num / cs2_den;
+		static constexpr bool depends_on_energy = false;
+		static inline double pressure(double density, double energy, double heat_capacity) {
+			return sound_speed_squared * density;
+		}
+	};
+
+	//low_eos below the critical density, high_eos above it, rescaled to be continuous at the switch.
+	//high_eos is divided by its pressure at the critical density, so it must not depend on the energy:
+	//an ideal gas there would be 0 at energy 0, which is where every particle starts
+	template<typename low_eos, typename high_eos, int critical_num, int critical_den = 1>
+	struct barotropic {
+		static_assert(!high_eos::depends_on_energy, "high_eos of barotropic has to depend on density only");
+		static constexpr double critical_density = (double)critical_num / critical_den;
+		static constexpr bool depends_on_energy = low_eos::depends_on_energy;
+		static inline double pressure(double density, double energy, double heat_capacity) {
+			if (std::abs(density) < critical_density)
+				return low_eos::pressure(density, energy, heat_capacity);
+			return low_eos::pressure(critical_density, energy, heat_capacity) *
+				high_eos::pressure(density, 0, 0) / high_eos::pressure(critical_density, 0, 0);
+		}
+	};
+
+	//what get_pressure always did: ideal gas plus a polytropic term weighted by (exponent - gamma)
+	template<int num, int den>
+	struct heated_polytrope {
+		static constexpr double big_C_coef = 8.3;
+		static constexpr bool depends_on_energy = true;
+		static inline double pressure(double density, double energy, double heat_capacity) {
+			return ideal_gas::pressure(density, energy, heat_capacity) +
+				big_C_coef * (polytrope<num, den>::exponent - heat_capacity) * polytrope<num, den>::pressure(density, energy, heat_capacity);
+		}
+	};
+}
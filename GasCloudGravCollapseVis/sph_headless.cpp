@@ -0,0 +1,429 @@
+//batch driver: no window, no GL, no Win32.
+//builds the processor from a particle file, a checkpoint or the disc generator, steps it at full speed
+//and writes the particles (and checkpoints) out every so many steps and at the end.
+//also runs the viewer's benchmarks, so their reports can be had from machines without a display.
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "grav_eq_iterator.h"
+#include "initial_conditions.h"
+#include "particle_io.h"
+#include "scaling_benchmark.h"
+#include "sph_deposit.h"
+#include "sph_precision.h"
+#include "sph_snapshot.h"
+#include "sph_trajectory.h"
+
+#ifndef _WIN32
+	#include <sys/types.h>
+	#include <sys/wait.h>
+	#include <unistd.h>
+	#define has_fork_checkpoints
+#endif
+
+struct run_settings {
+	std::string input;
+	std::string restart;
+	size_t particles = 1280;
+	unsigned seed = 1;
+	std::string profile = "disc";
+	double core = 0;
+	double rotation = 0;
+	double turbulence = 0;
+	double size = 100;
+	size_t steps = 0;
+	double until = 0;
+	size_t workers = 0;
+	bool pin = false;
+	size_t output_every = 0;
+	size_t checkpoint_every = 0;
+	bool fork_checkpoints = false;
+	std::string output = "snapshot";
+	std::string trajectory;
+	unsigned trajectory_bits = 0;
+	size_t grid = 0;
+	double time_step = 0;//0 keeps the processor's, or the checkpoint's on a restart
+	std::string benchmark;//"scaling" or "precision" instead of a run
+	size_t benchmark_particles = 0;//0 is the benchmark's own default
+};
+
+static void usage(const char* name) {
+	printf("usage: %s [options]\n"
+		"  --input FILE        initial particles (x y vx vy mass radius energy per line, or csv)\n"
+		"  --restart FILE      or carry on from a checkpoint\n"
+		"  --particles N       otherwise N generated particles (1280)\n"
+		"  --profile P         disc, plummer or isothermal (disc)\n"
+		"  --core R            plummer scale radius or isothermal core radius (a tenth of the cloud)\n"
+		"  --rotation W        angular velocity of the cloud (0)\n"
+		"  --turbulence V      rms of a random divergence-free velocity field (0)\n"
+		"  --seed S            seed of the generated cloud (1)\n"
+		"  --size L            side of the simulated square (100)\n"
+		"  --steps N           run N more steps\n"
+		"  --until T           or run until the simulated time T\n"
+		"  --time-step DT      largest time step (0.004, or the checkpoint's)\n"
+		"  --workers W         worker threads (cpus - 2)\n"
+		"  --pin               pin workers to cpus, numa node by node\n"
+		"  --output-every K    write the particles every K steps\n"
+		"  --checkpoint-every K  write a checkpoint every K steps\n"
+		"  --fork-checkpoints  write them from a forked child while the run goes on (not on windows)\n"
+		"  --output PREFIX     output files are PREFIX_<step>.txt, checkpoints PREFIX_<step>.sphs (snapshot)\n"
+		"  --trajectory FILE   write every step to FILE in the background\n"
+		"  --trajectory-bits B   quantize positions and velocities there to B bits (0 = exact, the default)\n"
+		"  --grid N            with every output and checkpoint, the SPH density of the square on N x N cells to PREFIX_<step>_density.txt\n"
+		"  --scaling-benchmark [N]    instead of a run, time --steps (20) of N particles (1280) on 1, 2, 4... up to --workers (all cpus)\n"
+		"  --precision-benchmark [N]  or float vs double SPH pair terms on N particles (4000)\n", name);
+}
+
+static bool parse(int argc, char** argv, run_settings& settings) {
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+		auto takes_value = [&]() {
+			if (!value) {
+				printf("%s needs a value\n", arg);
+				return false;
+			}
+			i++;
+			return true;
+		};
+		if (!strcmp(arg, "--pin"))
+			settings.pin = true;
+		else if (!strcmp(arg, "--fork-checkpoints"))
+			settings.fork_checkpoints = true;
+		else if (!strcmp(arg, "--help") || !strcmp(arg, "-h"))
+			return false;
+		else if (!strcmp(arg, "--scaling-benchmark") || !strcmp(arg, "--precision-benchmark")) {
+			settings.benchmark = (arg[2] == 's') ? "scaling" : "precision";
+			//the particle count is optional
+			if (value && value[0] != '-') {
+				settings.benchmark_particles = strtoull(value, nullptr, 10);
+				i++;
+			}
+		}
+		else if (!takes_value())
+			return false;
+		else if (!strcmp(arg, "--input"))
+			settings.input = value;
+		else if (!strcmp(arg, "--restart"))
+			settings.restart = value;
+		else if (!strcmp(arg, "--particles"))
+			settings.particles = strtoull(value, nullptr, 10);
+		else if (!strcmp(arg, "--profile"))
+			settings.profile = value;
+		else if (!strcmp(arg, "--core"))
+			settings.core = strtod(value, nullptr);
+		else if (!strcmp(arg, "--rotation"))
+			settings.rotation = strtod(value, nullptr);
+		else if (!strcmp(arg, "--turbulence"))
+			settings.turbulence = strtod(value, nullptr);
+		else if (!strcmp(arg, "--seed"))
+			settings.seed = (unsigned)strtoul(value, nullptr, 10);
+		else if (!strcmp(arg, "--size"))
+			settings.size = strtod(value, nullptr);
+		else if (!strcmp(arg, "--steps"))
+			settings.steps = strtoull(value, nullptr, 10);
+		else if (!strcmp(arg, "--until"))
+			settings.until = strtod(value, nullptr);
+		else if (!strcmp(arg, "--time-step"))
+			settings.time_step = strtod(value, nullptr);
+		else if (!strcmp(arg, "--workers"))
+			settings.workers = strtoull(value, nullptr, 10);
+		else if (!strcmp(arg, "--output-every"))
+			settings.output_every = strtoull(value, nullptr, 10);
+		else if (!strcmp(arg, "--checkpoint-every"))
+			settings.checkpoint_every = strtoull(value, nullptr, 10);
+		else if (!strcmp(arg, "--output"))
+			settings.output = value;
+		else if (!strcmp(arg, "--trajectory"))
+			settings.trajectory = value;
+		else if (!strcmp(arg, "--trajectory-bits"))
+			settings.trajectory_bits = (unsigned)strtoul(value, nullptr, 10);
+		else if (!strcmp(arg, "--grid"))
+			settings.grid = strtoull(value, nullptr, 10);
+		else {
+			printf("unknown option %s\n", arg);
+			return false;
+		}
+	}
+	if (settings.benchmark.empty() && !settings.steps && settings.until <= 0) {
+		printf("either --steps or --until is needed\n");
+		return false;
+	}
+	if (settings.profile != "disc" && settings.profile != "plummer" && settings.profile != "isothermal") {
+		printf("unknown profile %s\n", settings.profile.c_str());
+		return false;
+	}
+#ifndef has_fork_checkpoints
+	if (settings.fork_checkpoints) {
+		printf("--fork-checkpoints is not available here, checkpoints are written by the run itself\n");
+		settings.fork_checkpoints = false;
+	}
+#endif
+	return true;
+}
+
+static void write_output(grav_eq_processor& processor, const run_settings& settings) {
+	auto snapshot = processor.snapshot();
+	char name[32];
+	snprintf(name, sizeof(name), "_%06zu.txt", snapshot->step);
+	particle_io::write_particles(settings.output + name, *snapshot->tree, snapshot->step, snapshot->time);
+}
+
+//a cloud of the size of the viewer's start-up disc
+static std::vector<particle> generate(const run_settings& settings) {
+	initial_conditions::cloud config;
+	config.amount = settings.particles;
+	config.seed = settings.seed;
+	config.workers = settings.workers;
+	double radius = initial_conditions::viewer_disc_radius(settings.size);
+	double core = (settings.core > 0) ? settings.core : radius / 10;
+	auto particles = (settings.profile == "plummer") ? initial_conditions::plummer(config, core, radius) :
+		(settings.profile == "isothermal") ? initial_conditions::isothermal(config, core, radius) :
+		initial_conditions::uniform_disc(config, radius);
+	if (settings.rotation)
+		initial_conditions::add_rotation(particles, settings.rotation, { 0,0 }, settings.workers);
+	if (settings.turbulence > 0)
+		initial_conditions::add_turbulence(particles, settings.turbulence, settings.seed, 256, 8, settings.workers);
+	return particles;
+}
+
+static std::string checkpoint_path(const run_settings& settings, size_t step) {
+	char name[32];
+	snprintf(name, sizeof(name), "_%06zu.sphs", step);
+	return settings.output + name;
+}
+
+static void write_checkpoint(grav_eq_processor& processor, const run_settings& settings) {
+	auto snapshot = processor.snapshot();
+	sph_snapshot::write(checkpoint_path(settings, snapshot->step), *snapshot, sph_snapshot::parameters_of(processor));
+}
+
+//the density deposited on the grid, a row of cells per line from the bottom one up
+static void write_density_grid(grav_eq_processor& processor, const run_settings& settings) {
+	auto snapshot = processor.snapshot();
+	dsfield density(settings.grid);
+	sph_deposit::region area;
+	area.side = processor.__size;
+	sph_deposit::targets targets;
+	targets.density = &density;
+	sph_deposit::deposit(*snapshot, area, targets, settings.workers);
+
+	char name[48];
+	snprintf(name, sizeof(name), "_%06zu_density.txt", snapshot->step);
+	std::string path = settings.output + name;
+	std::vector<char> stream_buffer(1 << 20);
+	std::ofstream file;
+	file.rdbuf()->pubsetbuf(stream_buffer.data(), stream_buffer.size());
+	file.open(path);
+	if (!file)
+		throw std::runtime_error("cannot open " + path);
+	char line[128];
+	snprintf(line, sizeof(line), "# step %zu time %.17g side %.17g cells %zu\n", snapshot->step, snapshot->time, area.side, settings.grid);
+	file << line;
+	for (size_t y = 0; y < density.size(); y++) {
+		for (size_t x = 0; x < density.size(); x++) {
+			snprintf(line, sizeof(line), (x + 1 < density.size()) ? "%.9g " : "%.9g\n", density[y][x]);
+			file << line;
+		}
+	}
+	file.close();
+	if (!file)
+		throw std::runtime_error("cannot write " + path);
+}
+
+#ifdef has_fork_checkpoints
+//checkpoints written by a child process from its copy-on-write view of the run: the run only pays for fork().
+//one child at a time, so the pages the parent goes on to touch are copied at most once
+struct forked_checkpoints {
+	pid_t child = -1;
+	std::string path;
+	size_t count = 0;
+	double fork_time = 0;
+	double wait_time = 0;//spent on a child which was not done by the next checkpoint
+};
+
+static void wait_for_checkpoint(forked_checkpoints& forked) {
+	if (forked.child < 0)
+		return;
+	auto begin = std::chrono::steady_clock::now();
+	int status = 0;
+	pid_t result;
+	while ((result = waitpid(forked.child, &status, 0)) < 0 && errno == EINTR);
+	forked.wait_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	forked.child = -1;
+	if (result < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+		throw std::runtime_error("checkpoint " + forked.path + " was not written");
+}
+
+//between steps only: the workers are parked and hold no locks, and the child never needs them.
+//the child writes under a temporary name and renames, so a checkpoint on disk is always whole
+static void fork_checkpoint(grav_eq_processor& processor, const run_settings& settings, forked_checkpoints& forked) {
+	wait_for_checkpoint(forked);
+	auto snapshot = processor.snapshot();
+	auto parameters = sph_snapshot::parameters_of(processor);
+	std::string path = checkpoint_path(settings, snapshot->step);
+	fflush(stdout);
+	auto begin = std::chrono::steady_clock::now();
+	pid_t child = fork();
+	if (child < 0)
+		throw std::runtime_error("cannot fork for checkpoint " + path);
+	if (!child) {
+		int code = 0;
+		try {
+			sph_snapshot::write(path + ".part", *snapshot, parameters);
+			if (rename((path + ".part").c_str(), path.c_str()))
+				throw std::runtime_error("cannot rename " + path + ".part");
+		}
+		catch (const std::exception& e) {
+			fprintf(stderr, "error: %s\n", e.what());
+			code = 1;
+		}
+		_exit(code);
+	}
+	forked.fork_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	forked.count++;
+	forked.child = child;
+	forked.path = path;
+}
+#endif
+
+//still running: fewer steps than asked for, or simulated time short of the target
+static bool is_running(const grav_eq_processor& processor, const run_settings& settings, size_t first_step) {
+	if (settings.steps)
+		return processor.steps_done - first_step < settings.steps;
+	return processor.step_end_time < settings.until;
+}
+
+//steps up to the next output or checkpoint, 0 without any of them
+static size_t steps_to_next_write(size_t steps_done, const run_settings& settings) {
+	size_t steps = 0;
+	for (size_t every : { settings.output_every, settings.checkpoint_every }) {
+		if (!every)
+			continue;
+		size_t to_write = every - steps_done % every;
+		steps = steps ? min(steps, to_write) : to_write;
+	}
+	return steps;
+}
+
+int main(int argc, char** argv) {
+	run_settings settings;
+	if (!parse(argc, argv, settings)) {
+		usage(argv[0]);
+		return 1;
+	}
+	try {
+		if (settings.benchmark == "scaling") {
+			scaling_benchmark::run(settings.benchmark_particles ? settings.benchmark_particles : 1280,
+				settings.steps ? settings.steps : 20, settings.workers, true, settings.seed);
+			return 0;
+		}
+		if (settings.benchmark == "precision") {
+			sph_precision::benchmark<grav_eq_utils::kernel_type>(settings.benchmark_particles ? settings.benchmark_particles : 4000, 20, settings.seed);
+			return 0;
+		}
+		std::unique_ptr<sph_snapshot::snapshot_file> checkpoint;
+		std::vector<particle> particles;
+		if (settings.restart.size()) {
+			checkpoint = std::make_unique<sph_snapshot::snapshot_file>(settings.restart);
+			particles = checkpoint->particles();
+			settings.size = checkpoint->info().size;
+		}
+		else if (settings.input.size())
+			particles = particle_io::read_particles(settings.input, settings.workers);
+		else
+			particles = generate(settings);
+		printf("%zu initial particles\n", particles.size());
+
+		grav_eq_processor processor(particles, settings.size, settings.workers, settings.pin);
+		if (checkpoint) {
+			checkpoint->restore(processor);
+			checkpoint.reset();
+			printf("restarting at step %zu, t = %lf\n", processor.steps_done, processor.step_end_time);
+		}
+		//after restore(), which brings the time step of the checkpoint
+		if (settings.time_step > 0)
+			processor.time_step = settings.time_step;
+		std::unique_ptr<sph_trajectory::writer> trajectory;
+		if (settings.trajectory.size()) {
+			sph_trajectory::settings trajectory_settings;
+			trajectory_settings.quantization_bits = settings.trajectory_bits;
+			trajectory = std::make_unique<sph_trajectory::writer>(settings.trajectory, trajectory_settings);
+			trajectory->push(processor.snapshot());
+			processor.on_publish = [&](const std::shared_ptr<const state_snapshot>& snapshot) { trajectory->push(snapshot); };
+		}
+		processor.start_threads(true);
+
+#ifdef has_fork_checkpoints
+		forked_checkpoints forked;
+		auto write_due_checkpoint = [&]() {
+			if (settings.fork_checkpoints)
+				fork_checkpoint(processor, settings, forked);
+			else
+				write_checkpoint(processor, settings);
+		};
+#else
+		auto write_due_checkpoint = [&]() { write_checkpoint(processor, settings); };
+#endif
+
+		const size_t first_step = processor.steps_done;
+		auto begin = std::chrono::steady_clock::now();
+		while (is_running(processor, settings, first_step)) {
+			size_t to_write = steps_to_next_write(processor.steps_done, settings);
+			if (!to_write) {
+				if (settings.steps)
+					processor.step(settings.steps - (processor.steps_done - first_step));
+				else
+					processor.run_until(settings.until);
+				continue;
+			}
+			//one step at a time when the target is a time, so it is not overshot
+			processor.step(settings.steps ? min(to_write, settings.steps - (processor.steps_done - first_step)) : 1);
+			bool is_last = !is_running(processor, settings, first_step);
+			bool is_output_due = settings.output_every && (processor.steps_done % settings.output_every == 0 || is_last);
+			bool is_checkpoint_due = settings.checkpoint_every && (processor.steps_done % settings.checkpoint_every == 0 || is_last);
+			if (is_output_due)
+				write_output(processor, settings);
+			if (is_checkpoint_due)
+				write_due_checkpoint();
+			if (settings.grid && (is_output_due || is_checkpoint_due))
+				write_density_grid(processor, settings);
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		processor.stop_threads();
+
+		if (!settings.output_every) {
+			write_output(processor, settings);
+			if (settings.grid && !settings.checkpoint_every)
+				write_density_grid(processor, settings);
+		}
+#ifdef has_fork_checkpoints
+		wait_for_checkpoint(forked);
+		if (forked.count)
+			printf("%zu forked checkpoints, %.4lf s per fork, %.3lf s waited for children\n",
+				forked.count, forked.fork_time / forked.count, forked.wait_time);
+#endif
+		if (trajectory) {
+			trajectory->close();
+			auto stats = trajectory->statistics_so_far();
+			printf("trajectory: %zu steps, %.1lf MB of %.1lf MB, %zu stalls for %.3lf s\n", stats.frames,
+				stats.written_bytes / 1e6, stats.raw_bytes / 1e6, stats.stalls, stats.stall_time);
+		}
+		printf("%zu steps to t = %lf in %.3lf s (%.4lf s/step) on %zu workers\n",
+			processor.steps_done - first_step, processor.step_end_time, seconds, seconds / max<size_t>(processor.steps_done - first_step, 1), processor.num_of_threads);
+	}
+	catch (const std::exception& e) {
+		printf("error: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <type_traits>
+
+//smoothing kernels as compile-time policies.
+//every kernel is W(r, h) = sigma * shape(q) / h^dims, q = r / h, with compact support q < 1.
+//sigma_2d is the factor which makes shape(q) / h^2 integrate to one over the plane.
+//shape and shape_derivative are plain polynomials in q written in Horner form, so after
+//inlining a kernel evaluation is just a handful of multiplies.
+//they are templated over the number type, so the same code is used by the SIMD pair loop (sph_simd.h).
+//forced, because vector instantiations have to end up inside of the ISA-specific callers
+#if defined(_MSC_VER)
+	#define sph_kernel_inline __forceinline
+#elif defined(__GNUC__) || defined(__clang__)
+	#define sph_kernel_inline __attribute__((always_inline)) inline
+#else
+	#define sph_kernel_inline inline
+#endif
+
+namespace sph_kernels {
+	template<int power, typename T>
+	constexpr sph_kernel_inline T ipow(T x) {
+		if constexpr (power <= 0)
+			return T(1.);
+		else
+			return x * ipow<power - 1>(x);
+	}
+
+	//scalar version, vector types from sph_simd.h bring their own one
+	inline double select_le(double a, double b, double then_value, double else_value) {
+		return (a <= b) ? then_value : else_value;
+	}
+
+	//the one used since the beginning: 4 * (h - r)^3 / h^4
+	//its normalisation is not a 2D one, so it keeps its own sigma and dims
+	struct spiky {
+		static constexpr double sigma = 4.;
+		static constexpr int dims = 1;
+		static constexpr double sigma_2d = 10. / 3.1415926535897932384626433832795;
+		template<typename T>
+		static sph_kernel_inline T shape(T q) {
+			T t = 1. - q;
+			return t * t * t;
+		}
+		template<typename T>
+		static sph_kernel_inline T shape_derivative(T q) {
+			T t = 1. - q;
+			return -3. * t * t;
+		}
+	};
+
+	//M4 B-spline rescaled to the support of h, 2D normalisation
+	struct cubic_spline {
+		static constexpr double sigma = 40. / (7. * 3.1415926535897932384626433832795);
+		static constexpr int dims = 2;
+		static constexpr double sigma_2d = sigma;
+		template<typename T>
+		static sph_kernel_inline T shape(T q) {
+			T t = 1. - q;
+			return select_le(q, 0.5, 1. + q * q * (-6. + 6. * q), 2. * t * t * t);
+		}
+		template<typename T>
+		static sph_kernel_inline T shape_derivative(T q) {
+			T t = 1. - q;
+			return select_le(q, 0.5, q * (-12. + 18. * q), -6. * t * t);
+		}
+	};
+
+	//(1 - q)^4 * (1 + 4q), 2D normalisation
+	struct wendland_c2 {
+		static constexpr double sigma = 7. / 3.1415926535897932384626433832795;
+		static constexpr int dims = 2;
+		static constexpr double sigma_2d = sigma;
+		template<typename T>
+		static sph_kernel_inline T shape(T q) {
+			T t = 1. - q;
+			t = t * t;
+			return t * t * (1. + 4. * q);
+		}
+		template<typename T>
+		static sph_kernel_inline T shape_derivative(T q) {
+			T t = 1. - q;
+			return -20. * q * t * t * t;
+		}
+	};
+
+	//(1 - q)^6 * (1 + 6q + 35/3 q^2), 2D normalisation
+	struct wendland_c4 {
+		static constexpr double sigma = 9. / 3.1415926535897932384626433832795;
+		static constexpr int dims = 2;
+		static constexpr double sigma_2d = sigma;
+		template<typename T>
+		static sph_kernel_inline T shape(T q) {
+			T t = 1. - q;
+			t = t * t * t;
+			return t * t * (1. + q * (6. + q * (35. / 3.)));
+		}
+		template<typename T>
+		static sph_kernel_inline T shape_derivative(T q) {
+			T t = 1. - q;
+			T t2 = t * t;
+			return (-56. / 3.) * q * (1. + 5. * q) * t2 * t2 * t;
+		}
+	};
+
+	//any of the above sampled into a table over q in [0,1] and linearly interpolated.
+	//worth it only for kernels which are expensive to evaluate directly.
+	template<typename kernel, size_t resolution = 1024>
+	struct tabulated {
+		static constexpr double sigma = kernel::sigma;
+		static constexpr int dims = kernel::dims;
+		static constexpr double sigma_2d = kernel::sigma_2d;
+		using table = std::array<double, resolution + 2>;
+		static inline const table& shape_table() {
+			static const table t = []() {
+				table t;
+				for (size_t i = 0; i < t.size(); i++)
+					t[i] = (i < resolution) ? kernel::shape((double)i / resolution) : 0.;
+				return t;
+			}();
+			return t;
+		}
+		static inline const table& derivative_table() {
+			static const table t = []() {
+				table t;
+				for (size_t i = 0; i < t.size(); i++)
+					t[i] = (i < resolution) ? kernel::shape_derivative((double)i / resolution) : 0.;
+				return t;
+			}();
+			return t;
+		}
+		static inline double lookup(const table& t, double q) {
+			double pos = q * resolution;
+			size_t id = (size_t)pos;
+			if (id > resolution)
+				return 0.;
+			double frac = pos - id;
+			return t[id] + frac * (t[id + 1] - t[id]);
+		}
+		//vector types have no gather here, so they go lane by lane
+		template<typename T>
+		static sph_kernel_inline T shape(T q) {
+			if constexpr (std::is_same_v<T, double>)
+				return lookup(shape_table(), q);
+			else
+				return map_lanes(q, [](double x) { return lookup(shape_table(), x); });
+		}
+		template<typename T>
+		static sph_kernel_inline T shape_derivative(T q) {
+			if constexpr (std::is_same_v<T, double>)
+				return lookup(derivative_table(), q);
+			else
+				return map_lanes(q, [](double x) { return lookup(derivative_table(), x); });
+		}
+	};
+
+	//1/h and the normalisation factors of one particle, computed once and reused for all of its neighbours
+	template<typename kernel>
+	struct scale {
+		double h;
+		double inv_h;
+		double value_norm;
+		double gradient_norm;
+		explicit scale(double h) : h(h), inv_h(1. / h) {
+			value_norm = kernel::sigma * ipow<kernel::dims>(inv_h);
+			gradient_norm = value_norm * inv_h;
+		}
+		inline double value(double r) const {
+			double q = r * inv_h;
+			return (q < 1.) ? value_norm * kernel::shape(q) : 0.;
+		}
+		//dW/dr
+		inline double gradient(double r) const {
+			double q = r * inv_h;
+			return (q < 1.) ? gradient_norm * kernel::shape_derivative(q) : 0.;
+		}
+	};
+}
@@ -0,0 +1,114 @@
+#pragma once
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "sph_simd.h"
+
+//float vs double SPH pair terms on one synthetic cloud.
+//every particle gets the same neighbour lists in both precisions, so the difference is only the arithmetic.
+//the pair force is antisymmetric, so sum of m * dV over the cloud is zero up to rounding,
+//how far from zero it ends up is the conservation error of the precision.
+namespace sph_precision {
+	struct precision_report {
+		double pairs_per_second = 0;
+		double momentum_residual = 0;
+		double max_relative_error = 0;
+	};
+
+	struct synthetic_cloud {
+		std::vector<double> x, y, vx, vy, mass, h, p_over_rho2;
+		std::vector<std::vector<size_t>> neighbours;
+		size_t pairs = 0;
+
+		synthetic_cloud(size_t particles, double smoothing_length, unsigned seed) {
+			std::mt19937 gen(seed);
+			std::uniform_real_distribution<double> unit(0., 1.);
+			//box size picked to give about 30 neighbours per particle
+			double side = smoothing_length * std::sqrt(particles * 3.1415926535897932384626433832795 / 30.);
+			for (size_t i = 0; i < particles; i++) {
+				x.push_back(side * unit(gen));
+				y.push_back(side * unit(gen));
+				vx.push_back(unit(gen) - 0.5);
+				vy.push_back(unit(gen) - 0.5);
+				mass.push_back(0.5 + unit(gen));
+				h.push_back(smoothing_length * (0.75 + 0.5 * unit(gen)));
+				p_over_rho2.push_back(0.1 + unit(gen));
+			}
+			neighbours.resize(particles);
+			for (size_t i = 0; i < particles; i++) {
+				for (size_t j = 0; j < particles; j++) {
+					double dx = x[i] - x[j], dy = y[i] - y[j];
+					double support = std::max(h[i], h[j]);
+					if (i != j && dx * dx + dy * dy < support * support)
+						neighbours[i].push_back(j);
+				}
+				pairs += neighbours[i].size();
+			}
+		}
+
+		template<typename real>
+		inline void gather(size_t i, sph_simd::basic_neighbour_batch<real>& batch) const {
+			batch.clear();
+			for (auto j : neighbours[i])
+				batch.push(x[i] - x[j], y[i] - y[j], vx[i] - vx[j], vy[i] - vy[j], mass[j], std::max(h[i], h[j]), p_over_rho2[j]);
+		}
+	};
+
+	//fills dvx/dvy per particle and returns the time spent in the pair loop only
+	template<typename kernel, typename real>
+	inline double evaluate(const synthetic_cloud& cloud, std::vector<double>& dvx, std::vector<double>& dvy) {
+		const size_t particles = cloud.x.size();
+		std::vector<sph_simd::basic_neighbour_batch<real>> batches(particles);
+		for (size_t i = 0; i < particles; i++)
+			cloud.gather(i, batches[i]);
+		dvx.assign(particles, 0.);
+		dvy.assign(particles, 0.);
+		auto begin = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < particles; i++) {
+			auto sums = sph_simd::accumulate<kernel>(batches[i], cloud.p_over_rho2[i], 0.);
+			dvx[i] = sums.dvx;
+			dvy[i] = sums.dvy;
+		}
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	}
+
+	template<typename kernel, typename real>
+	inline precision_report measure(const synthetic_cloud& cloud, const std::vector<double>& reference_dvx, const std::vector<double>& reference_dvy, size_t repeats) {
+		precision_report report;
+		std::vector<double> dvx, dvy;
+		double time = 0;
+		for (size_t r = 0; r < repeats; r++)
+			time += evaluate<kernel, real>(cloud, dvx, dvy);
+		report.pairs_per_second = cloud.pairs * repeats / time;
+
+		double px = 0, py = 0, magnitude = 0;
+		for (size_t i = 0; i < dvx.size(); i++) {
+			px += cloud.mass[i] * dvx[i];
+			py += cloud.mass[i] * dvy[i];
+			magnitude += cloud.mass[i] * std::hypot(dvx[i], dvy[i]);
+			double reference = std::hypot(reference_dvx[i], reference_dvy[i]);
+			if (reference > 0)
+				report.max_relative_error = std::max(report.max_relative_error,
+					std::hypot(dvx[i] - reference_dvx[i], dvy[i] - reference_dvy[i]) / reference);
+		}
+		report.momentum_residual = (magnitude > 0) ? std::hypot(px, py) / magnitude : 0.;
+		return report;
+	}
+
+	template<typename kernel>
+	inline void benchmark(size_t particles = 4000, size_t repeats = 20, unsigned seed = 1) {
+		synthetic_cloud cloud(particles, 0.1, seed);
+		std::vector<double> reference_dvx, reference_dvy;
+		evaluate<kernel, double>(cloud, reference_dvx, reference_dvy);
+
+		auto full = measure<kernel, double>(cloud, reference_dvx, reference_dvy, repeats);
+		auto mixed = measure<kernel, float>(cloud, reference_dvx, reference_dvy, repeats);
+		printf("SPH pair precision: %zu particles, %zu pairs, isa %i\n", particles, cloud.pairs, (int)sph_simd::active_isa());
+		printf("  double: %10.4g pairs/s  momentum residual %.3g\n", full.pairs_per_second, full.momentum_residual);
+		printf("  float:  %10.4g pairs/s  momentum residual %.3g  max rel. error %.3g  speedup %.2f\n",
+			mixed.pairs_per_second, mixed.momentum_residual, mixed.max_relative_error, mixed.pairs_per_second / full.pairs_per_second);
+	}
+}
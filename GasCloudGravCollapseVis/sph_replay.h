@@ -0,0 +1,237 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "grav_eq_iterator.h"
+#include "sph_snapshot.h"
+
+//replay of a finished run from its snapshots (sph_snapshot) instead of simulating it again.
+//every file is mapped when the player opens, a thread of its own builds the trees of the frames around the one
+//asked for, the ones ahead in the direction of play first. whoever draws takes what is ready and never waits
+//for the disk: until the frame asked for is built, the last one which was shown stays
+namespace sph_replay {
+	//the files of paths, in that order, a directory stands for its .sphs files by name
+	inline std::vector<std::string> list_snapshots(const std::vector<std::string>& paths) {
+		std::vector<std::string> files;
+		for (auto& path : paths) {
+			if (!std::filesystem::is_directory(path)) {
+				files.push_back(path);
+				continue;
+			}
+			std::vector<std::string> found;
+			for (auto& entry : std::filesystem::directory_iterator(path))
+				if (entry.is_regular_file() && entry.path().extension() == ".sphs")
+					found.push_back(entry.path().string());
+			std::sort(found.begin(), found.end());
+			files.insert(files.end(), found.begin(), found.end());
+		}
+		return files;
+	}
+
+	struct frame {
+		size_t index;//in the player
+		size_t step;
+		double time;
+		std::shared_ptr<const quad_tree> tree;
+	};
+
+	//the tree the processor builds from the same particles
+	inline std::shared_ptr<const frame> load_frame(const sph_snapshot::snapshot_file& file, size_t index, size_t workers) {
+		auto tree = std::make_shared<quad_tree>(file.info().size);
+		tree->build(file.particles(), grav_eq_processor::tree_build_levels, workers ? workers : std::thread::hardware_concurrency());
+		return std::make_shared<const frame>(frame{ index, (size_t)file.info().step, file.info().time, tree });
+	}
+
+	struct settings {
+		//frames kept built ahead of the one asked for in the direction of play, and behind it.
+		//a tree takes about 0.4 GB per million particles
+		size_t ahead = 3;
+		size_t behind = 1;
+		size_t workers = 0;//threads of a tree build, 0 is all cpus
+	};
+
+	class player {
+		settings config;
+		std::vector<std::unique_ptr<sph_snapshot::snapshot_file>> files;//by step
+
+		mutable std::mutex locker;
+		std::condition_variable changed;
+		size_t target = 0;
+		int64_t direction = 1;
+		std::map<size_t, std::shared_ptr<const frame>> cache;
+		std::vector<char> is_broken;//frames which failed to load are not tried again
+		std::shared_ptr<const frame> shown;
+		std::string failure;
+		bool is_stopping = false;
+		std::thread prefetcher;
+
+		//the frames to keep built, in the order they are wanted: the target, then ahead of it, then behind.
+		//ahead and behind count the frames playback would show, so a run of broken ones does not eat up the window
+		inline std::vector<size_t> window() const {
+			std::vector<size_t> frames{ target };
+			auto add = [&](int64_t towards, size_t count) {
+				for (int64_t next = (int64_t)target + towards; count && next >= 0 && next < (int64_t)files.size(); next += towards) {
+					if (is_broken[(size_t)next])
+						continue;
+					frames.push_back((size_t)next);
+					count--;
+				}
+			};
+			add(direction, config.ahead);
+			add(-direction, config.behind);
+			return frames;
+		}
+
+		//the frame to build next; false once the window is built
+		inline bool next_wanted(size_t& index) const {
+			for (auto candidate : window()) {
+				if (!is_broken[candidate] && !cache.count(candidate)) {
+					index = candidate;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		//the first frame after the target in the direction given which did not fail to load, -1 past the end of the run
+		inline int64_t next_playable(int64_t towards) const {
+			int64_t next = (int64_t)target + towards;
+			while (next >= 0 && next < (int64_t)files.size() && is_broken[(size_t)next])
+				next += towards;
+			return (next >= 0 && next < (int64_t)files.size()) ? next : -1;
+		}
+
+		inline void prefetch() {
+			std::unique_lock<std::mutex> lock(locker);
+			while (!is_stopping) {
+				size_t index;
+				if (!next_wanted(index)) {
+					changed.wait(lock);
+					continue;
+				}
+				lock.unlock();
+				std::shared_ptr<const frame> loaded;
+				std::string error;
+				try {
+					loaded = load_frame(*files[index], index, config.workers);
+				}
+				catch (const std::exception& e) {
+					error = "frame " + std::to_string(index) + ": " + e.what();
+				}
+				//frames out of the window are freed after the lock is released, a big tree takes a while
+				std::vector<std::shared_ptr<const frame>> evicted;
+				lock.lock();
+				if (loaded)
+					cache[index] = loaded;
+				else {
+					is_broken[index] = 1;
+					failure = error;
+				}
+				auto kept = window();
+				for (auto it = cache.begin(); it != cache.end();) {
+					if (std::find(kept.begin(), kept.end(), it->first) != kept.end()) {
+						++it;
+						continue;
+					}
+					evicted.push_back(std::move(it->second));
+					it = cache.erase(it);
+				}
+				lock.unlock();
+				evicted.clear();
+				lock.lock();
+			}
+		}
+	public:
+		//throws if there is nothing to replay or a file is not a snapshot
+		explicit player(const std::vector<std::string>& paths, const settings& config = settings()) : config(config) {
+			for (auto& path : paths)
+				files.push_back(std::make_unique<sph_snapshot::snapshot_file>(path));
+			if (files.empty())
+				throw std::runtime_error("no snapshots to replay");
+			std::stable_sort(files.begin(), files.end(), [](auto& l, auto& r) { return l->info().step < r->info().step; });
+			is_broken.assign(files.size(), 0);
+			prefetcher = std::thread([this]() { prefetch(); });
+		}
+		~player() {
+			{
+				std::lock_guard<std::mutex> lock(locker);
+				is_stopping = true;
+			}
+			changed.notify_all();
+			prefetcher.join();
+		}
+		player(const player&) = delete;
+		player& operator=(const player&) = delete;
+
+		inline size_t size() const {
+			return files.size();
+		}
+		//the frame asked for, which may not be shown yet
+		inline size_t position() const {
+			std::lock_guard<std::mutex> lock(locker);
+			return target;
+		}
+		inline const sph_snapshot::file_header& info(size_t index) const {
+			return files[index]->info();
+		}
+
+		//scrubbing: any frame, clamped to the run; the prefetcher turns to it once the frame in hand is built
+		inline void seek(int64_t index) {
+			size_t clamped = (size_t)std::clamp<int64_t>(index, 0, (int64_t)files.size() - 1);
+			std::lock_guard<std::mutex> lock(locker);
+			int64_t new_direction = (clamped == target) ? direction : ((clamped > target) ? 1 : -1);
+			if (clamped == target && new_direction == direction)
+				return;
+			target = clamped;
+			direction = new_direction;
+			changed.notify_all();
+		}
+
+		//playback: one frame on in the direction given (+1 or -1) when it is built already, so playing goes
+		//as fast as the frames come and never stalls the caller; frames which failed to load are skipped.
+		//false at the ends of the run and while waiting
+		inline bool advance(int64_t towards = 1) {
+			std::lock_guard<std::mutex> lock(locker);
+			int64_t next = next_playable(towards);
+			if (towards != direction) {
+				direction = towards;
+				changed.notify_all();
+			}
+			if (next < 0 || !cache.count((size_t)next))
+				return false;
+			target = (size_t)next;
+			changed.notify_all();
+			return true;
+		}
+
+		//whether advance() has anywhere left to go, some time
+		inline bool has_next(int64_t towards = 1) const {
+			std::lock_guard<std::mutex> lock(locker);
+			return next_playable(towards) >= 0;
+		}
+
+		//the frame asked for once it is built, the last one returned before that; null until the first is built
+		inline std::shared_ptr<const frame> current() {
+			std::lock_guard<std::mutex> lock(locker);
+			auto found = cache.find(target);
+			if (found != cache.end())
+				shown = found->second;
+			return shown;
+		}
+
+		//what went wrong with the last frame which failed to load, empty if none did
+		inline std::string last_failure() const {
+			std::lock_guard<std::mutex> lock(locker);
+			return failure;
+		}
+	};
+}
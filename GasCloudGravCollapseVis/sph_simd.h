@@ -0,0 +1,395 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+#include <type_traits>
+#include "sph_kernels.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define sph_simd_x86
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+	#endif
+#endif
+
+//batched SPH pair loop.
+//neighbours of one particle are gathered into SoA arrays first, then the kernel gradient,
+//pressure acceleration, energy rate and velocity divergence are computed for a whole vector of
+//neighbours at once. the instruction set is picked at runtime, scalar path is the fallback.
+//pair terms are evaluated in the precision of the batch (double, or float for mixed precision),
+//per-particle sums are always accumulated in double.
+namespace sph_simd {
+	//everything the pair loop needs from one neighbour, stored column-wise.
+	//columns are always kept a multiple of max_width long, the tail is filled with lanes which do not interact.
+	//positions and velocities are stored relative to the source particle, which is what keeps float usable.
+	template<typename real>
+	struct basic_neighbour_batch {
+		static constexpr size_t max_width = 64 / sizeof(real);
+		using real_type = real;
+		std::vector<real> dx, dy, dvx, dvy, mass, h, p_over_rho2;
+		size_t count = 0;
+
+		inline void clear() {
+			count = 0;
+		}
+		inline size_t size() const {
+			return count;
+		}
+		inline size_t padded_size() const {
+			return (count + max_width - 1) / max_width * max_width;
+		}
+		inline void push(double dx_, double dy_, double dvx_, double dvy_, double mass_, double h_, double p_over_rho2_) {
+			if (count == dx.size())
+				grow();
+			dx[count] = (real)dx_;
+			dy[count] = (real)dy_;
+			dvx[count] = (real)dvx_;
+			dvy[count] = (real)dvy_;
+			mass[count] = (real)mass_;
+			h[count] = (real)h_;
+			p_over_rho2[count] = (real)p_over_rho2_;
+			count++;
+		}
+		//lanes outside of support with zero mass, they add exact zeroes
+		inline void seal() {
+			for (size_t i = count; i < padded_size(); i++)
+				set_idle(i);
+		}
+	private:
+		inline void set_idle(size_t i) {
+			dx[i] = 2.;
+			dy[i] = 0.;
+			dvx[i] = dvy[i] = 0.;
+			mass[i] = 0.;
+			h[i] = 1.;
+			p_over_rho2[i] = 0.;
+		}
+		inline void grow() {
+			size_t new_size = dx.size() + max_width;
+			for (auto column : { &dx, &dy, &dvx, &dvy, &mass, &h, &p_over_rho2 })
+				column->resize(new_size, 0.);
+		}
+	};
+
+	using neighbour_batch = basic_neighbour_batch<double>;
+
+	struct interaction_sums {
+		double dvx = 0;
+		double dvy = 0;
+		double de = 0;
+		double nabla_velocity = 0;
+		double max_mu = 0;
+	};
+
+	//one lane "vector", keeps the scalar path on the very same code as the wide ones
+	template<typename real>
+	struct vec_scalar {
+		static constexpr size_t width = 1;
+		using accumulator = vec_scalar<double>;
+		real v;
+		vec_scalar(double x = 0.) : v((real)x) {}
+		static inline vec_scalar load(const real* ptr) { return vec_scalar(*ptr); }
+		friend inline vec_scalar operator+(vec_scalar a, vec_scalar b) { return a.v + b.v; }
+		friend inline vec_scalar operator-(vec_scalar a, vec_scalar b) { return a.v - b.v; }
+		friend inline vec_scalar operator*(vec_scalar a, vec_scalar b) { return a.v * b.v; }
+		friend inline vec_scalar operator/(vec_scalar a, vec_scalar b) { return a.v / b.v; }
+		friend inline vec_scalar sqrt(vec_scalar a) { return std::sqrt(a.v); }
+		friend inline vec_scalar max(vec_scalar a, vec_scalar b) { return (a.v > b.v) ? a.v : b.v; }
+		friend inline vec_scalar select_le(vec_scalar a, vec_scalar b, vec_scalar t, vec_scalar e) { return (a.v <= b.v) ? t : e; }
+		friend inline vec_scalar select_lt(vec_scalar a, vec_scalar b, vec_scalar t, vec_scalar e) { return (a.v < b.v) ? t : e; }
+		template<typename F>
+		friend inline vec_scalar map_lanes(vec_scalar a, F f) { return f(a.v); }
+		friend inline void operator+=(accumulator& a, vec_scalar b) { a.v += b.v; }
+		friend inline double reduce_add(vec_scalar a) { return a.v; }
+		friend inline double reduce_max(vec_scalar a) { return a.v; }
+	};
+
+	//the generic body, instantiated once per vector type.
+	//must be inlined into the per-ISA entry points below, so it is compiled with their target options.
+	template<typename V, typename kernel, typename real>
+	sph_kernel_inline interaction_sums accumulate_batch(const basic_neighbour_batch<real>& batch, double p_over_rho2, double min_distance) {
+		constexpr double stabilizing_term = 0.01;
+		typename V::accumulator acc_dvx(0.), acc_dvy(0.), acc_de(0.), acc_nabla(0.);
+		V acc_mu(0.);
+		const V source_p_over_rho2(p_over_rho2), zero(0.), one(1.), eps(min_distance);
+		const size_t size = batch.padded_size();
+		for (size_t i = 0; i < size; i += V::width) {
+			V dx = V::load(&batch.dx[i]), dy = V::load(&batch.dy[i]);
+			V dvx = V::load(&batch.dvx[i]), dvy = V::load(&batch.dvy[i]);
+			V m = V::load(&batch.mass[i]), h = V::load(&batch.h[i]);
+			V neighbour_p_over_rho2 = V::load(&batch.p_over_rho2[i]);
+
+			V r2 = dx * dx + dy * dy;
+			V r = sqrt(r2);
+			V inv_h = one / h;
+			V q = r * inv_h;
+			V gradient_norm = V(kernel::sigma) * sph_kernels::ipow<kernel::dims + 1>(inv_h);
+			V dw_dr = select_lt(q, one, gradient_norm * kernel::shape_derivative(q), zero);
+			V g = select_lt(eps, r, dw_dr / r, zero);
+			V gx = g * dx, gy = g * dy;
+
+			V coef = m * (neighbour_p_over_rho2 + source_p_over_rho2);
+			V dv_dot_g = dvx * gx + dvy * gy;
+			acc_dvx += coef * gx;
+			acc_dvy += coef * gy;
+			acc_de += coef * dv_dot_g;
+			acc_nabla += m * dv_dot_g;
+
+			V prod = dvx * dx + dvy * dy;
+			acc_mu = max(acc_mu, select_lt(prod, zero, h * prod / (r2 + V(stabilizing_term)), zero));
+		}
+		interaction_sums sums;
+		sums.dvx = reduce_add(acc_dvx);
+		sums.dvy = reduce_add(acc_dvy);
+		sums.de = reduce_add(acc_de);
+		sums.nabla_velocity = reduce_add(acc_nabla);
+		sums.max_mu = reduce_max(acc_mu);
+		return sums;
+	}
+
+	template<typename kernel, typename real>
+	inline interaction_sums accumulate_scalar(const basic_neighbour_batch<real>& batch, double p_over_rho2, double min_distance) {
+		return accumulate_batch<vec_scalar<real>, kernel>(batch, p_over_rho2, min_distance);
+	}
+}
+
+#ifdef sph_simd_x86
+
+//msvc emits any intrinsic anywhere, gcc and clang want every function touching them marked
+#if defined(__GNUC__) || defined(__clang__)
+	#define sph_simd_avx2 __attribute__((target("avx2,fma")))
+	#define sph_simd_avx512 __attribute__((target("avx512f")))
+#else
+	#define sph_simd_avx2
+	#define sph_simd_avx512
+#endif
+
+namespace sph_simd {
+	struct vec_avx2 {
+		static constexpr size_t width = 4;
+		using accumulator = vec_avx2;
+		__m256d v;
+		sph_simd_avx2 vec_avx2(__m256d x) : v(x) {}
+		sph_simd_avx2 vec_avx2(double x = 0.) : v(_mm256_set1_pd(x)) {}
+		static sph_simd_avx2 inline vec_avx2 load(const double* ptr) { return _mm256_loadu_pd(ptr); }
+		friend sph_simd_avx2 inline vec_avx2 operator+(vec_avx2 a, vec_avx2 b) { return _mm256_add_pd(a.v, b.v); }
+		friend sph_simd_avx2 inline vec_avx2 operator-(vec_avx2 a, vec_avx2 b) { return _mm256_sub_pd(a.v, b.v); }
+		friend sph_simd_avx2 inline vec_avx2 operator*(vec_avx2 a, vec_avx2 b) { return _mm256_mul_pd(a.v, b.v); }
+		friend sph_simd_avx2 inline vec_avx2 operator/(vec_avx2 a, vec_avx2 b) { return _mm256_div_pd(a.v, b.v); }
+		friend sph_simd_avx2 inline void operator+=(vec_avx2& a, vec_avx2 b) { a.v = _mm256_add_pd(a.v, b.v); }
+		friend sph_simd_avx2 inline vec_avx2 sqrt(vec_avx2 a) { return _mm256_sqrt_pd(a.v); }
+		friend sph_simd_avx2 inline vec_avx2 max(vec_avx2 a, vec_avx2 b) { return _mm256_max_pd(a.v, b.v); }
+		friend sph_simd_avx2 inline vec_avx2 select_le(vec_avx2 a, vec_avx2 b, vec_avx2 t, vec_avx2 e) {
+			return _mm256_blendv_pd(e.v, t.v, _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ));
+		}
+		friend sph_simd_avx2 inline vec_avx2 select_lt(vec_avx2 a, vec_avx2 b, vec_avx2 t, vec_avx2 e) {
+			return _mm256_blendv_pd(e.v, t.v, _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ));
+		}
+		template<typename F>
+		friend sph_simd_avx2 inline vec_avx2 map_lanes(vec_avx2 a, F f) {
+			alignas(32) double lanes[width];
+			_mm256_store_pd(lanes, a.v);
+			for (auto& l : lanes)
+				l = f(l);
+			return _mm256_load_pd(lanes);
+		}
+		friend sph_simd_avx2 inline double reduce_add(vec_avx2 a) {
+			__m128d s = _mm_add_pd(_mm256_castpd256_pd128(a.v), _mm256_extractf128_pd(a.v, 1));
+			return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+		}
+		friend sph_simd_avx2 inline double reduce_max(vec_avx2 a) {
+			__m128d s = _mm_max_pd(_mm256_castpd256_pd128(a.v), _mm256_extractf128_pd(a.v, 1));
+			return _mm_cvtsd_f64(_mm_max_sd(s, _mm_unpackhi_pd(s, s)));
+		}
+	};
+
+	//8 float lanes, sums are widened into two double vectors
+	struct vec_avx2f {
+		static constexpr size_t width = 8;
+		struct accumulator {
+			vec_avx2 low, high;
+			sph_simd_avx2 accumulator(double x = 0.) : low(x), high(0.) {}
+			friend sph_simd_avx2 inline double reduce_add(const accumulator& a) { return reduce_add(a.low + a.high); }
+		};
+		__m256 v;
+		sph_simd_avx2 vec_avx2f(__m256 x) : v(x) {}
+		sph_simd_avx2 vec_avx2f(double x = 0.) : v(_mm256_set1_ps((float)x)) {}
+		static sph_simd_avx2 inline vec_avx2f load(const float* ptr) { return _mm256_loadu_ps(ptr); }
+		friend sph_simd_avx2 inline vec_avx2f operator+(vec_avx2f a, vec_avx2f b) { return _mm256_add_ps(a.v, b.v); }
+		friend sph_simd_avx2 inline vec_avx2f operator-(vec_avx2f a, vec_avx2f b) { return _mm256_sub_ps(a.v, b.v); }
+		friend sph_simd_avx2 inline vec_avx2f operator*(vec_avx2f a, vec_avx2f b) { return _mm256_mul_ps(a.v, b.v); }
+		friend sph_simd_avx2 inline vec_avx2f operator/(vec_avx2f a, vec_avx2f b) { return _mm256_div_ps(a.v, b.v); }
+		friend sph_simd_avx2 inline void operator+=(accumulator& a, vec_avx2f b) {
+			a.low += vec_avx2(_mm256_cvtps_pd(_mm256_castps256_ps128(b.v)));
+			a.high += vec_avx2(_mm256_cvtps_pd(_mm256_extractf128_ps(b.v, 1)));
+		}
+		friend sph_simd_avx2 inline vec_avx2f sqrt(vec_avx2f a) { return _mm256_sqrt_ps(a.v); }
+		friend sph_simd_avx2 inline vec_avx2f max(vec_avx2f a, vec_avx2f b) { return _mm256_max_ps(a.v, b.v); }
+		friend sph_simd_avx2 inline vec_avx2f select_le(vec_avx2f a, vec_avx2f b, vec_avx2f t, vec_avx2f e) {
+			return _mm256_blendv_ps(e.v, t.v, _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ));
+		}
+		friend sph_simd_avx2 inline vec_avx2f select_lt(vec_avx2f a, vec_avx2f b, vec_avx2f t, vec_avx2f e) {
+			return _mm256_blendv_ps(e.v, t.v, _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ));
+		}
+		template<typename F>
+		friend sph_simd_avx2 inline vec_avx2f map_lanes(vec_avx2f a, F f) {
+			alignas(32) float lanes[width];
+			_mm256_store_ps(lanes, a.v);
+			for (auto& l : lanes)
+				l = (float)f(l);
+			return _mm256_load_ps(lanes);
+		}
+		friend sph_simd_avx2 inline double reduce_max(vec_avx2f a) {
+			__m128 s = _mm_max_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1));
+			s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+			return _mm_cvtss_f32(_mm_max_ss(s, _mm_shuffle_ps(s, s, 1)));
+		}
+	};
+
+	template<typename kernel, typename real>
+	sph_simd_avx2 inline interaction_sums accumulate_avx2(const basic_neighbour_batch<real>& batch, double p_over_rho2, double min_distance) {
+		if constexpr (std::is_same_v<real, float>)
+			return accumulate_batch<vec_avx2f, kernel>(batch, p_over_rho2, min_distance);
+		else
+			return accumulate_batch<vec_avx2, kernel>(batch, p_over_rho2, min_distance);
+	}
+
+	struct vec_avx512 {
+		static constexpr size_t width = 8;
+		using accumulator = vec_avx512;
+		__m512d v;
+		sph_simd_avx512 vec_avx512(__m512d x) : v(x) {}
+		sph_simd_avx512 vec_avx512(double x = 0.) : v(_mm512_set1_pd(x)) {}
+		static sph_simd_avx512 inline vec_avx512 load(const double* ptr) { return _mm512_loadu_pd(ptr); }
+		friend sph_simd_avx512 inline vec_avx512 operator+(vec_avx512 a, vec_avx512 b) { return _mm512_add_pd(a.v, b.v); }
+		friend sph_simd_avx512 inline vec_avx512 operator-(vec_avx512 a, vec_avx512 b) { return _mm512_sub_pd(a.v, b.v); }
+		friend sph_simd_avx512 inline vec_avx512 operator*(vec_avx512 a, vec_avx512 b) { return _mm512_mul_pd(a.v, b.v); }
+		friend sph_simd_avx512 inline vec_avx512 operator/(vec_avx512 a, vec_avx512 b) { return _mm512_div_pd(a.v, b.v); }
+		friend sph_simd_avx512 inline void operator+=(vec_avx512& a, vec_avx512 b) { a.v = _mm512_add_pd(a.v, b.v); }
+		friend sph_simd_avx512 inline vec_avx512 sqrt(vec_avx512 a) { return _mm512_sqrt_pd(a.v); }
+		friend sph_simd_avx512 inline vec_avx512 max(vec_avx512 a, vec_avx512 b) { return _mm512_max_pd(a.v, b.v); }
+		friend sph_simd_avx512 inline vec_avx512 select_le(vec_avx512 a, vec_avx512 b, vec_avx512 t, vec_avx512 e) {
+			return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(a.v, b.v, _CMP_LE_OQ), e.v, t.v);
+		}
+		friend sph_simd_avx512 inline vec_avx512 select_lt(vec_avx512 a, vec_avx512 b, vec_avx512 t, vec_avx512 e) {
+			return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ), e.v, t.v);
+		}
+		template<typename F>
+		friend sph_simd_avx512 inline vec_avx512 map_lanes(vec_avx512 a, F f) {
+			alignas(64) double lanes[width];
+			_mm512_store_pd(lanes, a.v);
+			for (auto& l : lanes)
+				l = f(l);
+			return _mm512_load_pd(lanes);
+		}
+		friend sph_simd_avx512 inline double reduce_add(vec_avx512 a) {
+			return _mm512_reduce_add_pd(a.v);
+		}
+		friend sph_simd_avx512 inline double reduce_max(vec_avx512 a) {
+			return _mm512_reduce_max_pd(a.v);
+		}
+	};
+
+	//16 float lanes, sums are widened into two double vectors
+	struct vec_avx512f {
+		static constexpr size_t width = 16;
+		struct accumulator {
+			vec_avx512 low, high;
+			sph_simd_avx512 accumulator(double x = 0.) : low(x), high(0.) {}
+			friend sph_simd_avx512 inline double reduce_add(const accumulator& a) { return reduce_add(a.low + a.high); }
+		};
+		__m512 v;
+		sph_simd_avx512 vec_avx512f(__m512 x) : v(x) {}
+		sph_simd_avx512 vec_avx512f(double x = 0.) : v(_mm512_set1_ps((float)x)) {}
+		static sph_simd_avx512 inline vec_avx512f load(const float* ptr) { return _mm512_loadu_ps(ptr); }
+		friend sph_simd_avx512 inline vec_avx512f operator+(vec_avx512f a, vec_avx512f b) { return _mm512_add_ps(a.v, b.v); }
+		friend sph_simd_avx512 inline vec_avx512f operator-(vec_avx512f a, vec_avx512f b) { return _mm512_sub_ps(a.v, b.v); }
+		friend sph_simd_avx512 inline vec_avx512f operator*(vec_avx512f a, vec_avx512f b) { return _mm512_mul_ps(a.v, b.v); }
+		friend sph_simd_avx512 inline vec_avx512f operator/(vec_avx512f a, vec_avx512f b) { return _mm512_div_ps(a.v, b.v); }
+		friend sph_simd_avx512 inline void operator+=(accumulator& a, vec_avx512f b) {
+			a.low += vec_avx512(_mm512_cvtps_pd(_mm512_castps512_ps256(b.v)));
+			a.high += vec_avx512(_mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(b.v), 1))));
+		}
+		friend sph_simd_avx512 inline vec_avx512f sqrt(vec_avx512f a) { return _mm512_sqrt_ps(a.v); }
+		friend sph_simd_avx512 inline vec_avx512f max(vec_avx512f a, vec_avx512f b) { return _mm512_max_ps(a.v, b.v); }
+		friend sph_simd_avx512 inline vec_avx512f select_le(vec_avx512f a, vec_avx512f b, vec_avx512f t, vec_avx512f e) {
+			return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ), e.v, t.v);
+		}
+		friend sph_simd_avx512 inline vec_avx512f select_lt(vec_avx512f a, vec_avx512f b, vec_avx512f t, vec_avx512f e) {
+			return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ), e.v, t.v);
+		}
+		template<typename F>
+		friend sph_simd_avx512 inline vec_avx512f map_lanes(vec_avx512f a, F f) {
+			alignas(64) float lanes[width];
+			_mm512_store_ps(lanes, a.v);
+			for (auto& l : lanes)
+				l = (float)f(l);
+			return _mm512_load_ps(lanes);
+		}
+		friend sph_simd_avx512 inline double reduce_max(vec_avx512f a) {
+			return _mm512_reduce_max_ps(a.v);
+		}
+	};
+
+	template<typename kernel, typename real>
+	sph_simd_avx512 inline interaction_sums accumulate_avx512(const basic_neighbour_batch<real>& batch, double p_over_rho2, double min_distance) {
+		if constexpr (std::is_same_v<real, float>)
+			return accumulate_batch<vec_avx512f, kernel>(batch, p_over_rho2, min_distance);
+		else
+			return accumulate_batch<vec_avx512, kernel>(batch, p_over_rho2, min_distance);
+	}
+}
+
+#endif // sph_simd_x86
+
+namespace sph_simd {
+	enum class isa {
+		scalar, avx2, avx512
+	};
+
+	inline isa detect_isa() {
+#ifdef sph_simd_x86
+	#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		bool os_saves_ymm = (info[2] & (1 << 27)) && ((_xgetbv(0) & 0x6) == 0x6);
+		bool has_fma = info[2] & (1 << 12);
+		__cpuidex(info, 7, 0);
+		bool has_avx2 = os_saves_ymm && has_fma && (info[1] & (1 << 5));
+		bool has_avx512 = os_saves_ymm && (info[1] & (1 << 16)) && ((_xgetbv(0) & 0xE6) == 0xE6);
+	#else
+		__builtin_cpu_init();
+		bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+		bool has_avx512 = __builtin_cpu_supports("avx512f");
+	#endif
+		if (has_avx512)
+			return isa::avx512;
+		if (has_avx2)
+			return isa::avx2;
+#endif
+		return isa::scalar;
+	}
+
+	inline isa active_isa() {
+		static const isa detected = detect_isa();
+		return detected;
+	}
+
+	//p_over_rho2 is P/rho^2 of the source particle, pairs closer than min_distance get no gradient
+	template<typename kernel, typename real>
+	inline interaction_sums accumulate(basic_neighbour_batch<real>& batch, double p_over_rho2, double min_distance) {
+		batch.seal();
+		switch (active_isa()) {
+#ifdef sph_simd_x86
+		case isa::avx512:
+			return accumulate_avx512<kernel>(batch, p_over_rho2, min_distance);
+		case isa::avx2:
+			return accumulate_avx2<kernel>(batch, p_over_rho2, min_distance);
+#endif
+		default:
+			return accumulate_scalar<kernel>(batch, p_over_rho2, min_distance);
+		}
+	}
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "grav_eq_iterator.h"
+
+//the engine as a library: create a simulation, step it, read the particles of a step in place.
+//views keep their step alive for as long as they are held, no particle is ever copied for a reader;
+//the processor itself lays every step out as columns once, while its workers rebuild the tree.
+namespace sph {
+	//read-only contiguous range, std::span<const T> in spirit
+	template<typename T>
+	class column_view {
+		const T* first;
+		size_t count;
+	public:
+		column_view(const T* first = nullptr, size_t count = 0) : first(first), count(count) {}
+		column_view(const std::vector<T>& column) : first(column.data()), count(column.size()) {}
+
+		inline const T* data() const { return first; }
+		inline size_t size() const { return count; }
+		inline bool empty() const { return !count; }
+		inline const T* begin() const { return first; }
+		inline const T* end() const { return first + count; }
+		inline const T& operator[](size_t i) const { return first[i]; }
+	};
+
+	//one step of the simulation
+	class particle_view {
+		std::shared_ptr<const state_snapshot> snapshot;
+	public:
+		explicit particle_view(std::shared_ptr<const state_snapshot> snapshot) : snapshot(std::move(snapshot)) {}
+
+		inline size_t step() const { return snapshot->step; }
+		inline double time() const { return snapshot->time; }
+		inline size_t size() const { return snapshot->columns->size(); }
+
+		inline column_view<double> x() const { return snapshot->columns->x; }
+		inline column_view<double> y() const { return snapshot->columns->y; }
+		inline column_view<double> vx() const { return snapshot->columns->vx; }
+		inline column_view<double> vy() const { return snapshot->columns->vy; }
+		inline column_view<double> mass() const { return snapshot->columns->mass; }
+		inline column_view<double> radius() const { return snapshot->columns->radius; }
+		inline column_view<double> density() const { return snapshot->columns->density; }
+		inline column_view<double> energy() const { return snapshot->columns->energy; }
+
+		//the tree of the step, for neighbour queries
+		inline const quad_tree& tree() const { return *snapshot->tree; }
+	};
+
+	struct settings {
+		double size = 100;//side of the simulated square
+		double time_step = 0.004;//largest time step
+		size_t workers = 0;//0 is cpus - 2
+		bool pin_workers = false;
+	};
+
+	class simulation {
+	public:
+		using step_callback = std::function<void(const particle_view&)>;
+		using callback_id = size_t;
+
+	private:
+		grav_eq_processor processor;
+		std::mutex callbacks_locker;
+		std::vector<std::pair<callback_id, step_callback>> callbacks;
+		callback_id next_callback_id = 0;
+
+	public:
+		explicit simulation(const std::vector<particle>& initial, const settings& config = settings()) :
+			processor(initial, config.size, config.workers, config.pin_workers) {
+			processor.time_step = config.time_step;
+			processor.enable_columns();
+			processor.on_publish = [this](const std::shared_ptr<const state_snapshot>& snapshot) {
+				std::lock_guard<std::mutex> lock(callbacks_locker);
+				if (callbacks.empty())
+					return;
+				particle_view view(snapshot);
+				for (auto& callback : callbacks)
+					callback.second(view);
+			};
+			processor.start_threads(true);
+		}
+		~simulation() {
+			processor.stop_threads();
+		}
+		simulation(const simulation&) = delete;
+		simulation& operator=(const simulation&) = delete;
+
+		//both block until done
+		inline void step(size_t n = 1) {
+			processor.step(n);
+		}
+		inline void run_until(double t) {
+			processor.run_until(t);
+		}
+
+		//the latest step, from any thread
+		inline particle_view view() const {
+			return particle_view(processor.snapshot());
+		}
+
+		//called after every step, before the next one starts: the steps wait for the callbacks.
+		//to work on a step for longer, copy the view (it is a reference) and return
+		inline callback_id on_step(step_callback callback) {
+			std::lock_guard<std::mutex> lock(callbacks_locker);
+			callbacks.push_back({ next_callback_id, std::move(callback) });
+			return next_callback_id++;
+		}
+		//not from inside a callback
+		inline void remove_callback(callback_id id) {
+			std::lock_guard<std::mutex> lock(callbacks_locker);
+			for (auto it = callbacks.begin(); it != callbacks.end(); ++it) {
+				if (it->first == id) {
+					callbacks.erase(it);
+					return;
+				}
+			}
+		}
+
+		//heat capacity, flickering, performance counters and the rest of the engine
+		inline grav_eq_processor& engine() {
+			return processor;
+		}
+	};
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <cmath>
+#include <vector>
+
+#include "sph_kernels.h"
+
+//smoothing length from a target neighbour number.
+//the neighbour number is kernel-weighted, N(h) = pi * sigma_2d * sum shape(r_j / h),
+//which is the plain count for a uniform cloud but is continuous and monotone in h, so it can be solved for.
+//distances are gathered once per particle within the largest h allowed, every iteration reuses them.
+namespace sph_smoothing {
+	template<typename kernel>
+	struct solver {
+		double target;
+		double tolerance;
+		int max_iterations;
+		std::vector<double> distances;
+
+		struct result {
+			double h;
+			double neighbours;
+			int iterations;
+			bool converged;
+		};
+
+		solver(double target = 10., double tolerance = 0.05, int max_iterations = 16) :
+			target(target), tolerance(tolerance), max_iterations(max_iterations) {}
+
+		inline void clear() {
+			distances.clear();
+		}
+		inline void push(double distance) {
+			distances.push_back(distance);
+		}
+
+		//N(h) and dN/dh
+		inline double neighbours(double h, double* derivative = nullptr) const {
+			constexpr double norm = 3.1415926535897932384626433832795 * kernel::sigma_2d;
+			const double inv_h = 1. / h;
+			double n = 0, dn = 0;
+			for (auto r : distances) {
+				double q = r * inv_h;
+				if (q >= 1.)
+					continue;
+				n += kernel::shape(q);
+				dn -= kernel::shape_derivative(q) * q;
+			}
+			if (derivative)
+				*derivative = norm * dn * inv_h;
+			return norm * n;
+		}
+
+		//newton steps kept inside of a bracket, bisection whenever a step leaves it.
+		//too few candidates means h_max, too many means h_min, both are reported as not converged
+		inline result solve(double h, double h_min, double h_max) const {
+			double lo = h_min, hi = h_max;
+			if (neighbours(hi) < target)
+				return { hi, neighbours(hi), 0, false };
+			if (neighbours(lo) > target)
+				return { lo, neighbours(lo), 0, false };
+			h = (h > lo && h < hi) ? h : 0.5 * (lo + hi);
+			double derivative = 0;
+			for (int i = 1; i <= max_iterations; i++) {
+				double n = neighbours(h, &derivative);
+				double f = n - target;
+				if (std::abs(f) <= tolerance)
+					return { h, n, i, true };
+				if (f < 0)
+					lo = h;
+				else
+					hi = h;
+				double next = (derivative > 0) ? h - f / derivative : lo;
+				h = (next > lo && next < hi) ? next : 0.5 * (lo + hi);
+			}
+			return { h, neighbours(h), max_iterations, false };
+		}
+	};
+}
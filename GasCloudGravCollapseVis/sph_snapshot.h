@@ -0,0 +1,221 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "grav_eq_iterator.h"
+#include "mapped_file.h"
+
+//binary checkpoints, for restarts and for anything that wants to read a step without parsing text.
+//layout: file_header, column_count column_entry records, then every column as a flat little-endian array
+//starting at a multiple of 64 bytes. a reader maps the file and uses the columns where they are.
+//columns are found by name, so readers skip what they do not know and newer writers may add more
+namespace sph_snapshot {
+	constexpr char magic[8] = { 'S','P','H','S','N','A','P','\0' };
+	constexpr uint32_t version = 1;
+	constexpr uint32_t byte_order_mark = 0x01020304;
+	constexpr uint64_t alignment = 64;
+
+	enum class column_type : uint32_t {
+		f64 = 0, i32 = 1
+	};
+
+	struct file_header {
+		char magic[8];
+		uint32_t version;
+		uint32_t byte_order;
+		uint64_t particles;
+		uint64_t step;
+		double time;
+		//processor parameters a restart needs
+		double size;
+		double time_step;
+		double heat_capacity;
+		uint32_t column_count;
+		uint32_t reserved;
+	};
+	static_assert(sizeof(file_header) == 72, "file_header layout");
+
+	struct column_entry {
+		char name[16];
+		column_type type;
+		uint32_t element_size;
+		uint64_t offset;//from the start of the file
+	};
+	static_assert(sizeof(column_entry) == 32, "column_entry layout");
+
+	//everything a particle carries between steps, density is informational
+	struct f64_column {
+		const char* name;
+		double(*get)(const particle&);
+		void(*set)(particle&, double);
+	};
+	static const f64_column f64_columns[] = {
+		{ "x", [](const particle& p) { return p.position[0]; }, [](particle& p, double v) { p.position[0] = v; } },
+		{ "y", [](const particle& p) { return p.position[1]; }, [](particle& p, double v) { p.position[1] = v; } },
+		{ "vx", [](const particle& p) { return p.velocity[0]; }, [](particle& p, double v) { p.velocity[0] = v; } },
+		{ "vy", [](const particle& p) { return p.velocity[1]; }, [](particle& p, double v) { p.velocity[1] = v; } },
+		{ "ax", [](const particle& p) { return p.acceleration[0]; }, [](particle& p, double v) { p.acceleration[0] = v; } },
+		{ "ay", [](const particle& p) { return p.acceleration[1]; }, [](particle& p, double v) { p.acceleration[1] = v; } },
+		{ "mass", [](const particle& p) { return p.mass; }, [](particle& p, double v) { p.mass = v; } },
+		{ "radius", [](const particle& p) { return p.radius; }, [](particle& p, double v) { p.radius = v; } },
+		{ "energy", [](const particle& p) { return p.energy; }, [](particle& p, double v) { p.energy = v; } },
+		{ "density", [](const particle& p) { return p.density; }, [](particle& p, double v) { p.density = v; } },
+#ifdef is_variable_timestep
+		{ "cfl_time", [](const particle& p) { return p.cfl_time; }, [](particle& p, double v) { p.cfl_time = v; } },
+#endif
+		{ "cost", [](const particle& p) { return p.cost; }, [](particle& p, double v) { p.cost = v; } },
+	};
+	constexpr const char* interactions_column = "interactions";
+
+	struct parameters {
+		double size;
+		double time_step;
+		double heat_capacity;
+	};
+	inline parameters parameters_of(const grav_eq_processor& processor) {
+		return { processor.__size, processor.time_step, processor.heat_capacity };
+	}
+
+	inline uint64_t aligned(uint64_t offset) {
+		return (offset + alignment - 1) / alignment * alignment;
+	}
+
+	//one sequential pass: header and column table, then the columns in order, gathered in small blocks
+	inline void write(const std::string& path, const state_snapshot& snapshot, const parameters& params) {
+		std::vector<const particle*> particles;
+		snapshot.tree->for_each_particle([&](const particle& prt) { particles.push_back(&prt); });
+
+		constexpr size_t f64_count = sizeof(f64_columns) / sizeof(f64_columns[0]);
+		file_header header = {};
+		memcpy(header.magic, magic, sizeof(magic));
+		header.version = version;
+		header.byte_order = byte_order_mark;
+		header.particles = particles.size();
+		header.step = snapshot.step;
+		header.time = snapshot.time;
+		header.size = params.size;
+		header.time_step = params.time_step;
+		header.heat_capacity = params.heat_capacity;
+		header.column_count = (uint32_t)f64_count + 1;
+
+		std::vector<column_entry> table(header.column_count);
+		uint64_t offset = aligned(sizeof(file_header) + table.size() * sizeof(column_entry));
+		for (size_t c = 0; c < table.size(); c++) {
+			bool is_f64 = c < f64_count;
+			const char* name = is_f64 ? f64_columns[c].name : interactions_column;
+			memcpy(table[c].name, name, min(strlen(name), sizeof(table[c].name) - 1));
+			table[c].type = is_f64 ? column_type::f64 : column_type::i32;
+			table[c].element_size = is_f64 ? sizeof(double) : sizeof(int32_t);
+			table[c].offset = offset;
+			offset = aligned(offset + particles.size() * table[c].element_size);
+		}
+
+		std::vector<char> stream_buffer(1 << 20);
+		std::ofstream file;
+		file.rdbuf()->pubsetbuf(stream_buffer.data(), stream_buffer.size());
+		file.open(path, std::ios::binary | std::ios::trunc);
+		if (!file)
+			throw std::runtime_error("cannot open " + path);
+		uint64_t written = 0;
+		auto put = [&](const void* data, size_t bytes) {
+			if (!file.write((const char*)data, bytes))
+				throw std::runtime_error("cannot write " + path);
+			written += bytes;
+		};
+		auto pad_to = [&](uint64_t position) {
+			static const char zeros[alignment] = {};
+			while (written < position)
+				put(zeros, (size_t)min<uint64_t>(position - written, alignment));
+		};
+
+		put(&header, sizeof(header));
+		put(table.data(), table.size() * sizeof(column_entry));
+		constexpr size_t block = 4096;
+		std::vector<double> f64_block(block);
+		std::vector<int32_t> i32_block(block);
+		for (size_t c = 0; c < table.size(); c++) {
+			pad_to(table[c].offset);
+			for (size_t begin = 0; begin < particles.size(); begin += block) {
+				size_t end = min(begin + block, particles.size());
+				if (c < f64_count) {
+					for (size_t i = begin; i < end; i++)
+						f64_block[i - begin] = f64_columns[c].get(*particles[i]);
+					put(f64_block.data(), (end - begin) * sizeof(double));
+				}
+				else {
+					for (size_t i = begin; i < end; i++)
+						i32_block[i - begin] = particles[i]->interactions_count;
+					put(i32_block.data(), (end - begin) * sizeof(int32_t));
+				}
+			}
+		}
+		pad_to(offset);
+		file.close();
+		if (!file)
+			throw std::runtime_error("cannot write " + path);
+	}
+
+	//a mapped checkpoint, columns are pointers into the mapping
+	class snapshot_file {
+		mapped_file file;
+		const file_header* header;
+		const column_entry* table;
+
+		inline void check(bool condition, const char* what) const {
+			if (!condition)
+				throw std::runtime_error(std::string("not a valid snapshot: ") + what);
+		}
+	public:
+		explicit snapshot_file(const std::string& path) : file(path) {
+			check(file.size() >= sizeof(file_header), "too short");
+			header = (const file_header*)file.data();
+			table = (const column_entry*)(file.data() + sizeof(file_header));
+			check(!memcmp(header->magic, magic, sizeof(magic)), "magic");
+			check(header->version <= version, "newer version");
+			check(header->byte_order == byte_order_mark, "byte order");
+			check(sizeof(file_header) + (uint64_t)header->column_count * sizeof(column_entry) <= file.size(), "column table");
+			for (uint32_t c = 0; c < header->column_count; c++) {
+				check(table[c].offset % alignment == 0, "column alignment");
+				check(table[c].offset + header->particles * table[c].element_size <= file.size(), "column size");
+			}
+		}
+
+		inline const file_header& info() const {
+			return *header;
+		}
+
+		//nullptr if there is no such column of this type
+		template<typename T>
+		inline const T* column(const char* name) const {
+			for (uint32_t c = 0; c < header->column_count; c++)
+				if (!strncmp(table[c].name, name, sizeof(table[c].name)) && table[c].element_size == sizeof(T))
+					return (const T*)(file.data() + table[c].offset);
+			return nullptr;
+		}
+
+		//columns the file does not have keep the values of a default particle
+		inline std::vector<particle> particles() const {
+			std::vector<particle> result(header->particles, particle({ 0,0 }, { 0,0 }, { 0,0 }, 0, 0, 0, 1));
+			for (auto& spec : f64_columns) {
+				if (auto values = column<double>(spec.name))
+					for (size_t i = 0; i < result.size(); i++)
+						spec.set(result[i], values[i]);
+			}
+			if (auto values = column<int32_t>(interactions_column))
+				for (size_t i = 0; i < result.size(); i++)
+					result[i].interactions_count = values[i];
+			return result;
+		}
+
+		//the processor has to be built from particles() with info().size
+		inline void restore(grav_eq_processor& processor) const {
+			processor.time_step = header->time_step;
+			processor.heat_capacity = header->heat_capacity;
+			processor.set_clock(header->step, header->time);
+		}
+	};
+}
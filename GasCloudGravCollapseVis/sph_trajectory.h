@@ -0,0 +1,447 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "grav_eq_iterator.h"
+
+//per-step particle output for post-processing, written by a thread of its own.
+//layout: file_header, then one frame per step: frame_header, column_count times (column_header, packed column).
+//a column is transformed (xor with the previous value, or quantized and delta coded), its bytes are
+//split into planes (shuffle) and runs of zero bytes are collapsed. tree order keeps neighbours close,
+//so the upper planes are mostly zeros
+namespace sph_trajectory {
+	constexpr char magic[8] = { 'S','P','H','T','R','A','J','\0' };
+	constexpr uint32_t version = 1;
+	constexpr uint32_t byte_order_mark = 0x01020304;
+
+	struct file_header {
+		char magic[8];
+		uint32_t version;
+		uint32_t byte_order;
+	};
+	static_assert(sizeof(file_header) == 16, "file_header layout");
+
+	struct frame_header {
+		uint64_t step;
+		double time;
+		uint64_t particles;
+		uint32_t column_count;
+		uint32_t reserved;
+		uint64_t bytes;//of the columns which follow
+	};
+	static_assert(sizeof(frame_header) == 40, "frame_header layout");
+
+	enum class encoding : uint32_t {
+		xor_f64 = 0,//lossless: bits xor the bits of the previous value, 8 planes
+		quantized = 1//origin + quantum * q, q delta and zigzag coded, 4 planes
+	};
+
+	struct column_header {
+		char name[16];
+		encoding type;
+		uint32_t reserved;
+		double origin;
+		double quantum;
+		uint64_t bytes;//packed
+	};
+	static_assert(sizeof(column_header) == 48, "column_header layout");
+
+	//positions and velocities may be quantized, the rest is always exact
+	struct column_spec {
+		const char* name;
+		std::vector<double> particle_columns::* values;
+		bool is_quantizable;
+	};
+	static const column_spec columns[] = {
+		{ "x", &particle_columns::x, true },
+		{ "y", &particle_columns::y, true },
+		{ "vx", &particle_columns::vx, true },
+		{ "vy", &particle_columns::vy, true },
+		{ "mass", &particle_columns::mass, false },
+		{ "radius", &particle_columns::radius, false },
+		{ "density", &particle_columns::density, false },
+		{ "energy", &particle_columns::energy, false },
+	};
+
+	namespace codec {
+		inline void put_varint(std::vector<uint8_t>& out, uint64_t value) {
+			while (value >= 0x80) {
+				out.push_back((uint8_t)(value | 0x80));
+				value >>= 7;
+			}
+			out.push_back((uint8_t)value);
+		}
+		inline uint64_t get_varint(const uint8_t*& cur, const uint8_t* end) {
+			uint64_t value = 0;
+			for (int shift = 0; cur < end && shift < 64; shift += 7) {
+				uint8_t byte = *cur++;
+				value |= (uint64_t)(byte & 0x7F) << shift;
+				if (!(byte & 0x80))
+					return value;
+			}
+			throw std::runtime_error("truncated trajectory column");
+		}
+
+		//plane b holds byte b of every word; a zero byte is followed by the length of its run - 1
+		template<typename T>
+		inline void pack(const std::vector<T>& words, std::vector<uint8_t>& out) {
+			out.clear();
+			for (size_t b = 0; b < sizeof(T); b++) {
+				size_t zeros = 0;
+				for (auto word : words) {
+					uint8_t byte = (uint8_t)(word >> (8 * b));
+					if (!byte) {
+						zeros++;
+						continue;
+					}
+					if (zeros) {
+						out.push_back(0);
+						put_varint(out, zeros - 1);
+						zeros = 0;
+					}
+					out.push_back(byte);
+				}
+				if (zeros) {
+					out.push_back(0);
+					put_varint(out, zeros - 1);
+				}
+			}
+		}
+		template<typename T>
+		inline void unpack(const uint8_t* cur, const uint8_t* end, std::vector<T>& words) {
+			std::fill(words.begin(), words.end(), T(0));
+			for (size_t b = 0; b < sizeof(T); b++) {
+				for (size_t i = 0; i < words.size();) {
+					if (cur >= end)
+						throw std::runtime_error("truncated trajectory column");
+					uint8_t byte = *cur++;
+					if (byte) {
+						words[i++] |= (T)byte << (8 * b);
+						continue;
+					}
+					uint64_t run = get_varint(cur, end) + 1;
+					if (run > words.size() - i)
+						throw std::runtime_error("corrupt trajectory column");
+					i += (size_t)run;
+				}
+			}
+		}
+
+		inline uint64_t bits_of(double value) {
+			uint64_t bits;
+			memcpy(&bits, &value, sizeof(bits));
+			return bits;
+		}
+		inline double double_of(uint64_t bits) {
+			double value;
+			memcpy(&value, &bits, sizeof(value));
+			return value;
+		}
+		inline uint32_t zigzag(int64_t value) {
+			return (uint32_t)((value << 1) ^ (value >> 63));
+		}
+		inline int64_t unzigzag(uint32_t value) {
+			return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+		}
+	}
+
+	struct settings {
+		size_t queue_capacity = 4;//steps waiting to be written before push() blocks
+		unsigned quantization_bits = 0;//of positions and velocities, 0 keeps them exact; at most 31
+	};
+
+	//what the writer has done so far, for the performance report
+	struct statistics {
+		size_t frames = 0;
+		size_t stalls = 0;//push() calls which had to wait for room in the queue
+		double stall_time = 0;//seconds spent waiting there
+		size_t queue_peak = 0;
+		uint64_t raw_bytes = 0;//8 bytes per value
+		uint64_t written_bytes = 0;
+	};
+
+	//hand every step to push(), from on_publish for instance. the snapshot only keeps its tree (and columns)
+	//alive until the thread has written it, so nothing is copied on the step loop
+	class writer {
+		settings config;
+		std::vector<char> stream_buffer;
+		std::ofstream file;
+		std::string path;
+
+		mutable std::mutex locker;
+		std::condition_variable changed;
+		std::deque<std::shared_ptr<const state_snapshot>> queue;
+		bool is_closing = false;
+		std::exception_ptr failure;
+		statistics stats;
+		std::thread thread;
+
+		//scratch of the thread
+		particle_columns gathered;
+		std::vector<uint64_t> words64;
+		std::vector<uint32_t> words32;
+		std::vector<uint8_t> packed;
+		std::vector<char> frame;
+
+		inline void encode_column(const column_spec& spec, const std::vector<double>& values) {
+			column_header header = {};
+			memcpy(header.name, spec.name, min(strlen(spec.name), sizeof(header.name) - 1));
+			bool is_quantized = spec.is_quantizable && config.quantization_bits;
+			double low = 0, high = 0;
+			for (size_t i = 0; i < values.size() && is_quantized; i++) {
+				if (!std::isfinite(values[i]))
+					is_quantized = false;
+				low = i ? min<double>(low, values[i]) : values[i];
+				high = i ? max<double>(high, values[i]) : values[i];
+			}
+			if (is_quantized) {
+				header.type = encoding::quantized;
+				header.origin = low;
+				double levels = (double)((1u << config.quantization_bits) - 1);
+				header.quantum = (high > low) ? (high - low) / levels : 1;
+				words32.resize(values.size());
+				int64_t previous = 0;
+				for (size_t i = 0; i < values.size(); i++) {
+					int64_t q = std::llround((values[i] - low) / header.quantum);
+					words32[i] = codec::zigzag(q - previous);
+					previous = q;
+				}
+				codec::pack(words32, packed);
+			}
+			else {
+				header.type = encoding::xor_f64;
+				words64.resize(values.size());
+				uint64_t previous = 0;
+				for (size_t i = 0; i < values.size(); i++) {
+					uint64_t bits = codec::bits_of(values[i]);
+					words64[i] = bits ^ previous;
+					previous = bits;
+				}
+				codec::pack(words64, packed);
+			}
+			header.bytes = packed.size();
+			frame.insert(frame.end(), (const char*)&header, (const char*)&header + sizeof(header));
+			frame.insert(frame.end(), packed.begin(), packed.end());
+		}
+
+		inline void write_frame(const state_snapshot& snapshot) {
+			//the processor lays the columns out already when asked to, otherwise the tree is walked here
+			const particle_columns* source = snapshot.columns.get();
+			if (!source) {
+				gathered.gather(*snapshot.tree);
+				source = &gathered;
+			}
+			frame_header header = {};
+			header.step = snapshot.step;
+			header.time = snapshot.time;
+			header.particles = source->size();
+			header.column_count = sizeof(columns) / sizeof(columns[0]);
+			frame.assign(sizeof(header), 0);
+			for (auto& spec : columns)
+				encode_column(spec, source->*spec.values);
+			header.bytes = frame.size() - sizeof(header);
+			memcpy(frame.data(), &header, sizeof(header));
+			if (!file.write(frame.data(), frame.size()) || !file.flush())
+				throw std::runtime_error("cannot write " + path);
+
+			std::lock_guard<std::mutex> lock(locker);
+			stats.frames++;
+			stats.raw_bytes += header.particles * header.column_count * sizeof(double);
+			stats.written_bytes += frame.size();
+		}
+
+		inline void run() {
+			while (true) {
+				std::shared_ptr<const state_snapshot> snapshot;
+				{
+					std::unique_lock<std::mutex> lock(locker);
+					changed.wait(lock, [&]() { return queue.size() || is_closing; });
+					if (queue.empty())
+						return;
+					snapshot = queue.front();
+				}
+				try {
+					write_frame(*snapshot);
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(locker);
+					failure = std::current_exception();
+					queue.clear();
+					changed.notify_all();
+					return;
+				}
+				//popped only now, so a full queue really means capacity steps not written yet
+				std::lock_guard<std::mutex> lock(locker);
+				queue.pop_front();
+				changed.notify_all();
+			}
+		}
+
+	public:
+		writer(const std::string& path, const settings& config = settings()) :
+			config(config), stream_buffer(1 << 20), path(path) {
+			if (this->config.quantization_bits > 31)
+				throw std::invalid_argument("at most 31 quantization bits");
+			if (!this->config.queue_capacity)
+				this->config.queue_capacity = 1;
+			file.rdbuf()->pubsetbuf(stream_buffer.data(), stream_buffer.size());
+			file.open(path, std::ios::binary | std::ios::trunc);
+			if (!file)
+				throw std::runtime_error("cannot open " + path);
+			file_header header = {};
+			memcpy(header.magic, magic, sizeof(magic));
+			header.version = version;
+			header.byte_order = byte_order_mark;
+			if (!file.write((const char*)&header, sizeof(header)))
+				throw std::runtime_error("cannot write " + path);
+			thread = std::thread([this]() { run(); });
+		}
+		~writer() {
+			try {
+				close();
+			}
+			catch (...) {
+			}
+		}
+		writer(const writer&) = delete;
+		writer& operator=(const writer&) = delete;
+
+		//blocks while the queue is full; that wait is the backpressure counted in statistics.
+		//never throws, so it is safe from the workers: false once writing has failed, see close()
+		inline bool push(std::shared_ptr<const state_snapshot> snapshot) {
+			std::unique_lock<std::mutex> lock(locker);
+			if (queue.size() >= config.queue_capacity && !failure) {
+				auto begin = std::chrono::steady_clock::now();
+				changed.wait(lock, [&]() { return queue.size() < config.queue_capacity || failure; });
+				stats.stalls++;
+				stats.stall_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			}
+			if (failure || is_closing)
+				return false;
+			queue.push_back(std::move(snapshot));
+			stats.queue_peak = max<size_t>(stats.queue_peak, queue.size());
+			changed.notify_all();
+			return true;
+		}
+
+		//writes what is queued and stops the thread; rethrows what made writing fail
+		inline void close() {
+			{
+				std::lock_guard<std::mutex> lock(locker);
+				is_closing = true;
+				changed.notify_all();
+			}
+			if (thread.joinable())
+				thread.join();
+			if (file.is_open())
+				file.close();
+			if (failure)
+				std::rethrow_exception(failure);
+		}
+
+		inline statistics statistics_so_far() const {
+			std::lock_guard<std::mutex> lock(locker);
+			return stats;
+		}
+	};
+
+	//one decoded step
+	struct frame {
+		size_t step = 0;
+		double time = 0;
+		std::vector<std::string> names;
+		std::vector<std::vector<double>> values;
+
+		//nullptr if the frame has no such column
+		inline const std::vector<double>* column(const std::string& name) const {
+			for (size_t c = 0; c < names.size(); c++)
+				if (names[c] == name)
+					return &values[c];
+			return nullptr;
+		}
+	};
+
+	//reads the frames back in order
+	class reader {
+		std::ifstream file;
+		std::string path;
+		std::vector<char> bytes;
+		std::vector<uint64_t> words64;
+		std::vector<uint32_t> words32;
+
+		inline void check(bool condition, const char* what) const {
+			if (!condition)
+				throw std::runtime_error(path + ": not a valid trajectory: " + what);
+		}
+	public:
+		explicit reader(const std::string& path) : file(path, std::ios::binary), path(path) {
+			if (!file)
+				throw std::runtime_error("cannot open " + path);
+			file_header header = {};
+			file.read((char*)&header, sizeof(header));
+			check(file && !memcmp(header.magic, magic, sizeof(magic)), "magic");
+			check(header.version <= version, "newer version");
+			check(header.byte_order == byte_order_mark, "byte order");
+		}
+
+		//false at the end of the file
+		inline bool next(frame& out) {
+			frame_header header;
+			if (!file.read((char*)&header, sizeof(header)))
+				return false;
+			bytes.resize((size_t)header.bytes);
+			check((bool)file.read(bytes.data(), bytes.size()), "truncated frame");
+			out.step = (size_t)header.step;
+			out.time = header.time;
+			out.names.resize(header.column_count);
+			out.values.resize(header.column_count);
+			const char* cur = bytes.data();
+			const char* end = cur + bytes.size();
+			for (uint32_t c = 0; c < header.column_count; c++) {
+				column_header column;
+				check(end - cur >= (ptrdiff_t)sizeof(column), "truncated column");
+				memcpy(&column, cur, sizeof(column));
+				cur += sizeof(column);
+				check((uint64_t)(end - cur) >= column.bytes, "truncated column");
+				auto first = (const uint8_t*)cur, last = (const uint8_t*)cur + column.bytes;
+				cur += column.bytes;
+				out.names[c].assign(column.name, std::find(column.name, column.name + sizeof(column.name), '\0'));
+				auto& values = out.values[c];
+				values.resize((size_t)header.particles);
+				if (column.type == encoding::quantized) {
+					words32.resize(values.size());
+					codec::unpack(first, last, words32);
+					int64_t q = 0;
+					for (size_t i = 0; i < values.size(); i++) {
+						q += codec::unzigzag(words32[i]);
+						values[i] = column.origin + column.quantum * (double)q;
+					}
+				}
+				else {
+					check(column.type == encoding::xor_f64, "unknown encoding");
+					words64.resize(values.size());
+					codec::unpack(first, last, words64);
+					uint64_t bits = 0;
+					for (size_t i = 0; i < values.size(); i++) {
+						bits ^= words64[i];
+						values[i] = codec::double_of(bits);
+					}
+				}
+			}
+			return true;
+		}
+	};
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+	#include <Windows.h>
+#else
+	#include <pthread.h>
+	#include <sched.h>
+	#include <filesystem>
+#endif
+
+//pinning threads to logical cpus and finding out which numa node a cpu belongs to.
+//memory is placed on the node of the thread which touches it first (the default policy on both Windows and Linux),
+//so a pinned worker gets local scratch just by allocating and filling it itself.
+namespace thread_affinity {
+#ifdef _WIN32
+	//cpus are numbered across processor groups, group after group; a group is not always 64 cpus wide
+	inline PROCESSOR_NUMBER processor_of(size_t cpu) {
+		WORD groups = GetActiveProcessorGroupCount();
+		for (WORD group = 0; group < groups; group++) {
+			size_t in_group = GetActiveProcessorCount(group);
+			if (cpu < in_group)
+				return { group, (BYTE)cpu, 0 };
+			cpu -= in_group;
+		}
+		return { 0, 0, 0 };
+	}
+#endif
+
+	//the cpus this process may run on (taskset, cgroups, cpusets, job objects), in increasing order
+	inline std::vector<size_t> allowed_cpus() {
+		std::vector<size_t> cpus;
+#ifdef _WIN32
+		USHORT group_count = 0;
+		GetProcessGroupAffinity(GetCurrentProcess(), &group_count, nullptr);
+		std::vector<USHORT> process_groups(group_count);
+		if (group_count && GetProcessGroupAffinity(GetCurrentProcess(), &group_count, process_groups.data())) {
+			//the affinity mask is of the one group of the process, a process over several groups has all of their cpus
+			DWORD_PTR process_mask = 0, system_mask = 0;
+			bool is_masked = group_count == 1 && GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask) && process_mask;
+			size_t first = 0;
+			for (WORD group = 0; group < GetActiveProcessorGroupCount(); group++) {
+				size_t in_group = GetActiveProcessorCount(group);
+				if (std::find(process_groups.begin(), process_groups.end(), group) != process_groups.end())
+					for (size_t i = 0; i < in_group; i++)
+						if (!is_masked || ((process_mask >> i) & 1))
+							cpus.push_back(first + i);
+				first += in_group;
+			}
+		}
+#else
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (!sched_getaffinity(0, sizeof(set), &set))
+			for (size_t cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &set))
+					cpus.push_back(cpu);
+#endif
+		if (cpus.empty()) {
+			size_t count = std::thread::hardware_concurrency();
+			for (size_t cpu = 0; cpu < (count ? count : 1); cpu++)
+				cpus.push_back(cpu);
+		}
+		return cpus;
+	}
+
+	inline size_t cpu_count() {
+		return allowed_cpus().size();
+	}
+
+	inline int numa_node_of(size_t cpu) {
+#ifdef _WIN32
+		PROCESSOR_NUMBER processor = processor_of(cpu);
+		USHORT node = 0;
+		if (!GetNumaProcessorNodeEx(&processor, &node))
+			return 0;
+		return node;
+#else
+		std::error_code error;
+		for (auto& entry : std::filesystem::directory_iterator("/sys/devices/system/cpu/cpu" + std::to_string(cpu), error)) {
+			auto name = entry.path().filename().string();
+			if (name.size() > 4 && name.compare(0, 4, "node") == 0)
+				return std::stoi(name.substr(4));
+		}
+		return 0;
+#endif
+	}
+
+	//false if the cpu is not one the process may run on, or the system refused
+	inline bool pin_current_thread(size_t cpu) {
+#ifdef _WIN32
+		PROCESSOR_NUMBER processor = processor_of(cpu);
+		GROUP_AFFINITY affinity = {};
+		affinity.Group = processor.Group;
+		affinity.Mask = (KAFFINITY)1 << processor.Number;
+		return SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+#else
+		if (cpu >= CPU_SETSIZE)
+			return false;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+	}
+
+	//allowed cpus ordered by numa node, so consecutive workers fill one node before spilling onto the next one
+	inline std::vector<size_t> cpus_by_numa_node() {
+		std::vector<std::pair<int, size_t>> nodes;
+		for (auto cpu : allowed_cpus())
+			nodes.push_back({ numa_node_of(cpu), cpu });
+		std::stable_sort(nodes.begin(), nodes.end(),
+			[](const std::pair<int, size_t>& a, const std::pair<int, size_t>& b) { return a.first < b.first; });
+		std::vector<size_t> cpus;
+		for (auto& node : nodes)
+			cpus.push_back(node.second);
+		return cpus;
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+//per-worker task deques with stealing.
+//the owner pushes and pops at the back (most recent first, keeps it on the subtree it has just split),
+//thieves take from the front, where the oldest and so usually the biggest tasks are.
+//pending counts tasks pushed but not finished yet, a running task may still push children,
+//so the step is over only when it drops to zero.
+namespace work_stealing {
+	template<typename task>
+	class worker_deque {
+		std::mutex locker;
+		std::deque<task> tasks;
+	public:
+		inline void push(const task& t) {
+			std::lock_guard<std::mutex> lock(locker);
+			tasks.push_back(t);
+		}
+		inline bool pop(task& t) {
+			std::lock_guard<std::mutex> lock(locker);
+			if (tasks.empty())
+				return false;
+			t = tasks.back();
+			tasks.pop_back();
+			return true;
+		}
+		inline bool steal(task& t) {
+			std::lock_guard<std::mutex> lock(locker);
+			if (tasks.empty())
+				return false;
+			t = tasks.front();
+			tasks.pop_front();
+			return true;
+		}
+	};
+
+	template<typename task>
+	class scheduler {
+		std::vector<worker_deque<task>> deques;
+		std::atomic<size_t> pending;
+		std::atomic<size_t> steals;
+	public:
+		explicit scheduler(size_t workers) : deques(workers), pending(0), steals(0) {}
+
+		inline size_t workers() const {
+			return deques.size();
+		}
+		inline void push(size_t worker, const task& t) {
+			pending++;
+			deques[worker].push(t);
+		}
+		//own deque first, then the others starting from the next worker
+		inline bool next(size_t worker, task& t) {
+			if (deques[worker].pop(t))
+				return true;
+			for (size_t i = 1; i < deques.size(); i++) {
+				if (deques[(worker + i) % deques.size()].steal(t)) {
+					steals++;
+					return true;
+				}
+			}
+			return false;
+		}
+		inline void done() {
+			pending--;
+		}
+		inline bool finished() const {
+			return pending == 0;
+		}
+		//steals since the previous call
+		inline size_t take_steals() {
+			return steals.exchange(0);
+		}
+	};
+}